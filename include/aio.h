@@ -0,0 +1,104 @@
+// aio - asynchronous pread/pwrite
+//
+// Requests go to an io_uring when the kernel has one to offer, and
+// otherwise to a pool of threads making the blocking calls. Either way
+// at most depth requests are in flight; submitting another waits for
+// one to finish. Completion callbacks run on the ring's reaper thread or
+// a pool thread, so they should be quick - typically just waking up
+// whoever is waiting (see AioBatch) - and must not wait on other
+// requests.
+//
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+
+namespace libcf {
+
+#define AIO_DEPTH   32              // default requests in flight
+#define AIO_PIECE   (512*1024)      // AioBatch transfers in pieces this big
+
+// A fixed set of threads running queued jobs in order of arrival.
+class WorkQueue
+{
+private:
+    std::mutex                        _mtx;
+    std::condition_variable           _cv;      // a job was queued, or stopping
+    std::condition_variable           _idle;    // nothing queued or running
+    std::deque<std::function<void()>> _jobs;
+    size_t                            _busy;
+    bool                              _stop;
+    std::vector<std::thread>          _threads;
+
+    void run();
+
+public:
+    WorkQueue(unsigned threads);
+    ~WorkQueue();       // finishes what is queued first
+    void push(std::function<void()> job);
+    void wait();
+};
+
+class AsyncIO
+{
+public:
+    // res is what pread or pwrite would return, or -errno
+    typedef std::function<void(ssize_t res)> Callback;
+
+private:
+    struct Ring;
+    std::unique_ptr<Ring>      _ring;       // io_uring, if in use
+    std::unique_ptr<WorkQueue> _pool;       // otherwise
+    unsigned                   _depth;
+    std::mutex                 _mtx;
+    std::condition_variable    _room;       // a request finished
+    unsigned                   _in_flight;
+
+public:
+    AsyncIO(unsigned depth = AIO_DEPTH, bool use_uring = true);
+    ~AsyncIO();         // waits for requests in flight
+
+    // With more set, another request follows at once and the two may
+    // go to the kernel together.
+    void read(int fd, void *buf, size_t len, off_t pos, Callback cb, bool more = false);
+    void write(int fd, const void *buf, size_t len, off_t pos, Callback cb, bool more = false);
+    bool     uring() const { return (bool)_ring; }
+    unsigned depth() const { return _depth; }
+
+private:
+    void submit(bool write, int fd, void *buf, size_t len, off_t pos, Callback cb, bool more);
+    bool ring_setup();
+    bool ring_enter();
+    void ring_reap();
+    void ring_close();
+};
+
+// A group of transfers to wait on together. Each is split into
+// AIO_PIECE pieces, so one large transfer keeps several requests in
+// flight at once.
+class AioBatch
+{
+private:
+    std::mutex              _mtx;
+    std::condition_variable _cv;
+    size_t                  _left;
+    bool                    _ok;
+
+    void transfer(AsyncIO& aio, bool write, int fd, uint8_t *buf, size_t len, off_t pos);
+
+public:
+    AioBatch();
+    ~AioBatch();        // waits
+    void read(AsyncIO& aio, int fd, void *buf, size_t len, off_t pos);
+    void write(AsyncIO& aio, int fd, const void *buf, size_t len, off_t pos);
+    bool wait();        // true if every piece went through in full
+};
+
+} // namespace libcf
@@ -0,0 +1,51 @@
+// bloom - Bloom filter over 64-bit hashes
+//
+// The caller hashes its own keys (see hash64) and hands the filter the
+// hash; the k probe positions are derived from it by double hashing.
+// contains() never returns a false negative.
+//
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+namespace libcf {
+
+#pragma pack(1)
+
+struct BloomHeader
+{
+    uint32_t _magic;
+    uint32_t _version;
+    uint64_t _bits;
+    uint32_t _hashes;
+    uint64_t _count;
+    uint64_t _capacity;
+};
+
+#pragma pack()
+
+class BloomFilter
+{
+private:
+    std::vector<uint64_t> _words;
+    uint64_t              _bits;
+    uint32_t              _hashes;
+    uint64_t              _count;       // keys added
+    uint64_t              _capacity;    // keys the filter was sized for
+
+public:
+    BloomFilter();
+    BloomFilter(size_t capacity, double fpr, size_t max_bytes = 0);
+    void   add(uint64_t hash);
+    bool   contains(uint64_t hash) const;
+    size_t count()    const { return _count; }
+    size_t capacity() const { return _capacity; }
+    size_t bytes()    const { return _words.size() * sizeof(uint64_t); }
+    double fpr()      const;
+    bool   save(std::FILE *fp) const;
+    bool   load(std::FILE *fp);
+};
+
+} // namespace libcf
@@ -0,0 +1,39 @@
+// brlock - "big reader" lock
+//
+// A reader/writer lock split into cache-line sized shards. Each thread
+// takes its read lock on one shard, so readers on different cores never
+// write to the same cache line; a writer has to take every shard.
+// Meant for state that is read on every operation and changed rarely.
+//
+// Satisfies SharedMutex, so it works with std::shared_lock and
+// std::unique_lock.
+//
+#pragma once
+#include <cstddef>
+#include <shared_mutex>
+
+namespace libcf {
+
+#define BRLOCK_SHARDS   16
+
+class BRLock
+{
+private:
+    struct alignas(64) Shard
+    {
+        std::shared_mutex _mtx;
+    };
+    Shard _shards[ BRLOCK_SHARDS ];
+
+    static size_t shard();
+
+public:
+    void lock();
+    bool try_lock();
+    void unlock();
+    void lock_shared()     { _shards[ shard() ]._mtx.lock_shared(); }
+    bool try_lock_shared() { return _shards[ shard() ]._mtx.try_lock_shared(); }
+    void unlock_shared()   { _shards[ shard() ]._mtx.unlock_shared(); }
+};
+
+} // namespace libcf
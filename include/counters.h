@@ -0,0 +1,45 @@
+// counters - event counters spread over per-thread shards
+//
+// Each thread adds into a shard of its own (threads past CTR_SHARDS
+// double up), so counting from many threads at once doesn't bounce one
+// cache line between them. Reading sums the shards, and is only as
+// current as the adds it happens to see.
+//
+// Latency histograms are just runs of LAT_BUCKETS counters, one per
+// power of two nanoseconds.
+//
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace libcf {
+
+#define CTR_SHARDS  16
+#define LAT_BUCKETS 40              // up to 2^40 ns, some 18 minutes
+
+class ShardedCounters
+{
+private:
+    size_t                             _cnt;
+    size_t                             _stride;     // per shard, whole cache lines
+    std::vector<std::atomic<uint64_t>> _store;
+    std::atomic<uint64_t>             *_vals;       // _store, cache line aligned
+
+    static unsigned shard();
+
+public:
+    ShardedCounters(size_t cnt);
+    void add(size_t i, uint64_t n = 1) {
+        _vals[ shard() * _stride + i ].fetch_add( n, std::memory_order_relaxed );
+    }
+    uint64_t get(size_t i) const;
+    void reset();
+    size_t size() const { return _cnt; }
+
+    // histogram bucket for a latency of ns nanoseconds
+    static unsigned lat_bucket(uint64_t ns);
+};
+
+} // namespace libcf
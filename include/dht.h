@@ -4,25 +4,74 @@
 // freakishly fast way to collect positions and check for collissions
 // without thrashing the disk.
 //
-// Use the high two-digits of MD5 as hash into 256 buckets.
-// Files are binary with fixed-length records.
+// Keys are hashed to a 64-bit value whose low bits select a bucket
+// file. Files are binary with fixed-length records.
 //
+// The table starts with a power-of-two number of buckets (BUCKET_HI
+// unless DhtOptions::bucket_count says otherwise) and grows by linear
+// hashing: whenever a bucket passes DhtOptions::split_threshold
+// records, the bucket at the split pointer is split in two using one
+// more bit of the hash, and the pointer advances. Once every bucket of
+// the current round has split, the round (level) doubles. The starting
+// count, level and split pointer live in the table header.
+//
+// When the table is closed or checkpointed, the header is followed by a
+// manifest of every bucket's record count, so opening a table is one
+// read rather than a stat per bucket. The manifest is marked stale by
+// the first change after it was written. Bucket files, indexes and
+// Bloom filters are opened when a bucket is first used.
+//
+// Tables written before the table header existed used the first
+// BUCKET_ID_WIDTH hex digits of the key's MD5 as the bucket id. They
+// are detected on open and keep using md5_hasher, which puts those
+// digits in the low bits of its result.
+//
+// Erasing a record leaves it in place, marked in a per-bucket tombstone
+// bitmap (the <base>_<bucket>.del sidecar) that lookups and iteration
+// skip. Compaction rewrites a bucket without its erased records - on
+// demand through compact(), or from a background thread once enough of
+// a bucket is dead (DhtOptions::compact_ratio).
+//
+// All operations may be called from any number of threads. Lookups on
+// the same bucket run side by side; writes to a bucket are serialized,
+// and a split briefly stops the whole table. Iterating with dht<K,V>
+// is the exception - it must not run alongside inserts that split, or
+// alongside compaction.
 //
 #pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
 #include <filesystem>
+#include <functional>
 #include <map>
 #include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <span>
 #include <sstream>
 #include <thread>
+#include <vector>
 
+#include "aio.h"
+#include "bloom.h"
+#include "brlock.h"
+#include "counters.h"
+#include "fpool.h"
+#include "fprint.h"
+#include "hash.h"
+#include "keyscan.h"
 #include "md5.h"
+#include "rcache.h"
 
 namespace libcf {
 
 #define BUCKET_ID_WIDTH 3
+#define DHT_ITER_BLOCK  (1024*1024) // bytes an iterator reads at a time
+#define RUN_MEMTABLE    (1024*1024) // default memtable bytes with sorted runs
+#define DIRECT_ALIGN    4096        // direct I/O unit, a multiple of any device block
 const unsigned short BUCKET_LO  = 0;
 const unsigned short BUCKET_HI  = 1 << (4 * BUCKET_ID_WIDTH );
 
@@ -33,77 +82,552 @@ typedef std::shared_ptr<uchar[]> BuffPtr;
 
 // dht_comparitor returns true if lhs == rhs
 typedef bool (*dht_comparitor)(const void *lhs, const void *rhs, size_t keysize);
-// dht_hasher computes a hash of key, and returns the first n chars
-typedef std::string (*dht_hasher)(const void *key, size_t keysize, size_t n);
+// dht_hasher computes a 64-bit hash of key
+typedef uint64_t (*dht_hasher)(const void *key, size_t keysize);
+
+// which hasher a table was built with
+enum DhtHashKind : uint32_t {
+    DHT_HASH_CUSTOM = 0,
+    DHT_HASH_FAST,          // default_hasher
+    DHT_HASH_MD5            // md5_hasher, for pre-header tables
+};
 
 class NAUGHT_TYPE{};
 
+// per-element outcome of the batch operations
+enum DhtResult : uchar {
+    DHT_MISSING = 0,
+    DHT_FOUND,
+    DHT_INSERTED,
+    DHT_UPDATED,
+    DHT_ERROR
+};
+
+// operations counted and timed by DiskHashTable::stats()
+enum DhtOp : uchar {
+    DHT_OP_SEARCH = 0,
+    DHT_OP_INSERT,              // insert and find_or_insert
+    DHT_OP_UPSERT,
+    DHT_OP_APPEND,
+    DHT_OP_UPDATE,
+    DHT_OP_ERASE,
+    DHT_OP_CNT
+};
+
+// Table-wide tuning knobs. Everything here is optional; the defaults
+// give the original plain-bucket-file behavior.
+struct DhtOptions
+{
+    // maintain a per-bucket open-addressed hash slot sidecar
+    // (<base>_<bucket>.idx) so lookups cost O(1) I/O instead of
+    // a full bucket scan.
+    bool use_index = false;
+
+    // descriptors the table may keep open between operations. 0 sizes
+    // the pool from RLIMIT_NOFILE; negative disables pooling, so each
+    // operation opens and closes its bucket files.
+    long max_open_files = 0;
+
+    // scan buckets through a shared memory mapping rather than
+    // copying them through a read buffer
+    bool use_mmap = false;
+
+    // read the bucket files with O_DIRECT, around the page cache, so
+    // scanning a table far larger than memory doesn't evict everything
+    // else. Reads are whole DIRECT_ALIGN blocks into aligned buffers;
+    // small ones (lookups) go through a block cache of up to
+    // direct_cache_bytes (0 for none). Bulk writes - flushes of the
+    // write buffer, compaction and splits - are written back and
+    // dropped from the page cache as they go. Rules out use_mmap and
+    // async scans; ignored where the file system can't do direct I/O.
+    bool   direct_io          = false;
+    size_t direct_cache_bytes = 0;
+
+    // keep an in-memory Bloom filter per bucket, persisted in a
+    // <base>_<bucket>.blm sidecar, so most lookups of absent keys
+    // never touch the disk. 0 disables; otherwise the target false
+    // positive rate, optionally capped at bloom_max_bytes per bucket.
+    double bloom_fpr       = 0;
+    size_t bloom_max_bytes = 0;
+
+    // keep 8 or 16 bits of each record's key hash in memory, in record
+    // order, so a lookup without the index scans those rather than the
+    // bucket and reads only the records whose fingerprint matches. 0
+    // disables; built from the bucket when first used.
+    unsigned fingerprint_bits = 0;
+
+    // buckets a new table starts with (rounded up to a power of two);
+    // 0 means BUCKET_HI. Ignored for existing tables.
+    size_t bucket_count    = 0;
+
+    // keep each bucket's values in a parallel <base>_<bucket>.val file
+    // rather than after each key, so lookups scan only the keys and
+    // read a value once its key is found. Pays off for values wider
+    // than their keys. Ignored for existing tables, which keep the
+    // layout they were created with.
+    bool split_values      = false;
+
+    // keep each bucket as runs of records sorted by key hash: appends
+    // collect in a memtable (write_buffer bytes, or RUN_MEMTABLE if
+    // that is 0) that is sorted and written out as a new run when full,
+    // and lookups binary-search the runs newest first. A background
+    // thread merges a bucket's runs into one once it has more than
+    // max_runs (0 leaves that to compact()). Ignored for existing
+    // tables; takes the place of use_index, fingerprint_bits and
+    // split_values.
+    bool   sorted_runs     = false;
+    size_t max_runs        = 8;
+
+    // split a bucket (linear hashing) once any bucket holds more than
+    // this many records; 0 never splits
+    size_t split_threshold = 0;
+
+    // bytes of appended records a bucket may hold in memory before
+    // writing them out in one go (0 writes each record through), and
+    // the longest a record may wait there, checked on each append
+    // (0 waits for the size threshold, flush() or close).
+    size_t   write_buffer    = 0;
+    unsigned write_buffer_ms = 0;
+
+    // keep up to this many recently found records in memory, so repeat
+    // lookups of hot keys skip the bucket altogether. 0 disables.
+    size_t cache_records   = 0;
+
+    // compact a bucket in the background once this fraction of its
+    // records have been erased (0 leaves it to compact()), reading and
+    // writing at most compact_bytes_per_sec while doing so (0 for no
+    // limit)
+    double compact_ratio         = 0;
+    size_t compact_bytes_per_sec = 0;
+
+    // read bucket scans ahead and write buffered appends through an
+    // io_uring (or, failing that or with async_uring off, a pool of
+    // threads), keeping up to async_depth requests in flight. The same
+    // depth sizes the workers behind search_async and insert_async.
+    bool     async_io    = false;
+    unsigned async_depth = AIO_DEPTH;
+    bool     async_uring = true;
+
+    // time every operation into a latency histogram for stats(); the
+    // counts are kept regardless
+    bool latency_stats = false;
+};
+
+struct DhtVerifyStats
+{
+    size_t   _buckets;
+    uint64_t _records;          // live records
+    uint64_t _duplicates;       // records whose key came earlier in the bucket
+    uint64_t _misplaced;        // records whose key belongs in another bucket
+    uint64_t _min;              // records in the smallest bucket
+    uint64_t _max;              // and the largest
+    size_t   _min_bucket;
+    size_t   _max_bucket;
+    double   _mean;
+    double   _stddev;
+};
+
+struct DhtOpStats
+{
+    uint64_t _count;            // batch calls count each key
+    uint64_t _total_ns;         // with latency_stats, batch calls aside
+    uint64_t _hist[ LAT_BUCKETS ];  // [i] took 2^i to 2^(i+1) ns
+};
+
+// activity since the bucket was last loaded, or over the whole table
+struct DhtBucketStats
+{
+    uint64_t _scanned;          // records looked at by lookup scans
+    uint64_t _bytes_read;       // through pread (or async reads), not the mapping
+    uint64_t _bytes_written;
+    uint64_t _opens;            // of the bucket file
+    uint64_t _lock_waits;       // times the bucket lock was busy
+    uint64_t _lock_wait_ns;     // and the time spent waiting for it
+};
+
+struct DhtBloomStats
+{
+    size_t   _buckets;          // buckets with a filter
+    size_t   _bytes;            // memory held by all filters
+    uint64_t _keys;
+    double   _fpr;              // expected false positive rate at current fill
+    uint64_t _negatives;        // lookups answered by a filter alone
+    uint64_t _false_positives;  // lookups a filter passed that missed on disk
+};
+
+struct DhtStats
+{
+    DhtOpStats       _ops[ DHT_OP_CNT ];
+    uint64_t         _hits;     // searches that found the key
+    uint64_t         _misses;
+    DhtBucketStats   _total;    // all buckets, including ones split since
+    std::vector<DhtBucketStats> _buckets;   // if asked for
+    FilePoolStats    _files;
+    DhtBloomStats    _bloom;
+    RecordCacheStats _cache;
+    RecordCacheStats _blocks;   // direct I/O block cache, in blocks
+
+    std::string json() const;
+};
+
+#pragma pack(1)
+
+// <base>.dht in the table directory
+struct TableHeader
+{
+    uint32_t _magic;
+    uint32_t _version;
+    uint32_t _hash_kind;
+    uint32_t _bucket_cnt;   // buckets currently in use
+    uint64_t _keylen;
+    uint64_t _vallen;
+    // version 2
+    uint64_t _base_cnt;     // buckets at level 0
+    uint32_t _level;        // completed doublings
+    uint64_t _split;        // next bucket to split this round
+    // version 3
+    uint32_t _flags;        // TABLE_FLAG_*
+};
+
+// Optionally follows the TableHeader; older readers ignore it.
+struct TableManifest
+{
+    uint32_t _magic;
+    uint32_t _clean;        // counts are current; cleared by the first change
+    uint64_t _count_cnt;    // record counts that follow, one per bucket,
+                            // then as many counts of erased records
+};
+
+// Bucket index sidecar layout: header followed by _capacity slots.
+struct BucketIndexHeader
+{
+    uint32_t _magic;
+    uint32_t _version;
+    uint64_t _capacity;     // number of slots (always a power of two)
+    uint64_t _count;        // records 0.._count-1 are indexed
+};
+
+struct BucketIndexSlot
+{
+    uint64_t _hash;         // full key hash
+    uint64_t _recno;        // record number + 1, or 0 if the slot is free
+};
+
+// Bucket tombstone sidecar: header followed by _words of bitmap, bit n
+// set if record n is erased.
+struct BucketDeadHeader
+{
+    uint32_t _magic;
+    uint32_t _version;
+    uint64_t _ino;          // inode of the bucket file the bits belong to
+    uint64_t _count;        // bits set
+    uint64_t _words;
+};
+
+#pragma pack()
+
 class DiskHashTable {
-    struct BucketFile {
+    friend class DhtBuilder;
+public:
+    // fn( recs, cnt ) is handed cnt consecutive records of key then value
+    typedef std::function<void(ucharptr_c recs, size_t cnt)> BlockFunc;
+
+private:
+    // a bucket lock that notes how often, and for how long, taking it
+    // had to wait
+    struct BucketMutex : public std::shared_mutex {
+        std::atomic<uint64_t> _waits{0};
+        std::atomic<uint64_t> _wait_ns{0};
+        void lock();
+        void lock_shared();
+    };
+
+    // Each bucket has a reader/writer lock: lookups share it, anything
+    // that changes the bucket takes it exclusively. Reads go through
+    // pread/pwrite (or the mapping) so concurrent readers need no file
+    // position of their own.
+    struct BucketFile : public PooledFile {
+        // borrow the bucket's files from the table's pool for the
+        // duration of an operation
         struct file_guard {
             BucketFile& _bf;
-            bool        _was_open;
+            bool        _pinned;
             file_guard(BucketFile& bf) : _bf(bf) {
-                _was_open = _bf._fp != nullptr;
-                if ( !_was_open )
-                    _bf.open();
+                _pinned = _bf._pool->borrow( _bf );
             }
 
             ~file_guard() {
-                if ( !_was_open )
-                    _bf.close();
+                if ( _pinned )
+                    _bf._pool->release( _bf );
             }
         };
 
-        static std::map<size_t, BuffPtr> buff_map;
-
-        std::mutex     _mtx;
-        std::FILE*     _fp;
+        BucketMutex    _mtx;
+        FilePool*      _pool;
+        RecordCache*   _cache;     // the table's, if it has one
+        AsyncIO*       _aio;       // likewise
+        key_scan_fn    _keyscan;   // null unless keys compare with memcmp
+        int            _fd;
+        int            _vfd;       // values file, with split values
         std::string    _fspec;
+        std::atomic<bool> _ready;   // prepare() has run
         size_t         _keylen;
         size_t         _vallen;
-        size_t         _reccnt;
+        std::atomic<size_t> _reccnt;
         size_t         _reclen;
+        bool           _split_vals;
+        size_t         _stride;    // bytes per record in the bucket file
         dht_comparitor _compfunc;
 
+        // optional hash slot index
+        int            _ifd;
+        bool           _use_index;
+        bool           _idx_ready;
+        bool           _idx_dirty;
+        size_t         _idx_cap;
+        size_t         _idx_cnt;
+
+        // optional memory mapping of the bucket file. The mapping only
+        // grows, and is published length last; outgrown mappings stay
+        // in place until the bucket goes away, as a reader may still be
+        // using one.
+        bool           _use_mmap;
+        std::mutex     _map_mtx;
+        std::atomic<ucharptr> _map;
+        std::atomic<size_t>   _map_len;
+        std::vector<std::pair<void*, size_t>> _old_maps;
+
+        // optional Bloom filter over the bucket's keys
+        std::unique_ptr<BloomFilter> _bloom;
+        double         _bloom_fpr;
+        size_t         _bloom_max_bytes;
+        bool           _bloom_dirty;
+        std::atomic<uint64_t> _bloom_negatives;
+        std::atomic<uint64_t> _bloom_false_pos;
+
+        // with direct I/O, O_DIRECT descriptors to read the bucket and
+        // values files through, and the table's block cache, which
+        // knows them by _file_id (renewed when the files are replaced)
+        bool           _direct;
+        int            _dfd;
+        int            _dvfd;
+        RecordCache*   _blocks;
+        uint64_t       _file_id;
 
-        BucketFile( std::string fspec,
+        // optional resident fingerprints of the bucket's keys
+        std::unique_ptr<Fingerprints> _fps;
+        unsigned       _fp_bits;
+
+        // with sorted runs, the runs making up the bucket file, each
+        // with the first hash of every block of it, and the memtable:
+        // the hash of each record in the write buffer, in hash order
+        struct Run {
+            size_t   _start;
+            size_t   _cnt;
+            std::vector<uint64_t> _fence;
+        };
+        bool           _sorted;
+        size_t         _max_runs;
+        std::vector<Run> _runs;
+        std::atomic<size_t> _run_cnt;
+        std::multimap<uint64_t, size_t> _mem;   // hash to record in _pend
+
+        // erased records, and while a compaction is copying the bucket,
+        // records updated or erased since it began
+        std::vector<uint64_t> _dead;
+        std::atomic<size_t>   _dead_cnt;
+        bool           _dead_dirty;
+        bool           _compacting;
+        std::vector<size_t> _compact_log;
+        bool           _retired;    // split away; the file is no longer ours
+
+        // activity counts, see DhtBucketStats
+        std::atomic<uint64_t> _scanned;
+        std::atomic<uint64_t> _bytes_read;
+        std::atomic<uint64_t> _bytes_written;
+        std::atomic<uint64_t> _opens;
+
+        // write-back buffer of appended records not yet on disk;
+        // records _disk_cnt.._reccnt-1 live here (their values in
+        // _vpend with split values)
+        std::vector<uchar> _pend;
+        std::vector<uchar> _vpend;
+        size_t         _disk_cnt;
+        size_t         _wbuf_bytes;
+        unsigned       _wbuf_ms;
+        std::chrono::steady_clock::time_point _pend_since;
+
+        BucketFile( FilePool& pool,
+                    std::string fspec,
                     size_t key_len,
                     size_t val_len = 0,
-                    dht_comparitor comp_func = default_comparitor);
+                    dht_comparitor comp_func = default_comparitor,
+                    const DhtOptions& opts = DhtOptions(),
+                    long rec_cnt = -1,
+                    long dead_cnt = -1);
         ~BucketFile();
         bool open();
         bool close();
+        bool   pool_open()  override { return open();  }
+        bool   pool_close() override { return close(); }
+        size_t pool_fds() const override { return ( 1 + _split_vals ) * ( 1 + _direct ) + _use_index; }
+        void  prepare();
+        void  prepare_nolock();
         off_t search(ucharptr_c key, ucharptr   val = nullptr);
         bool  append(ucharptr_c key, ucharptr_c val = nullptr);
         bool  update(ucharptr_c key, ucharptr_c val = nullptr);
-        bool  read(size_t recno, ucharptr key, ucharptr val);
+        bool  erase(ucharptr_c key);
+        DhtResult upsert(ucharptr_c key, ucharptr_c val);
+        DhtResult find_or_insert(ucharptr_c key, ucharptr_c val, ucharptr existing);
+        size_t read_block(size_t from, size_t max, ucharptr dst, std::vector<bool> *dead = nullptr);
+        void  scan_blocks(const BlockFunc& fn);
 
-        size_t seek();
-        BuffPtr get_file_buff();
+        // batch operations on keys[items[j]] (and vals[items[j]])
+        typedef std::vector<size_t> ItemList;
+        size_t search_batch(const ItemList& items, ucharptr_c keys, ucharptr   vals, DhtResult *results);
+        size_t insert_batch(const ItemList& items, ucharptr_c keys, ucharptr_c vals, DhtResult *results);
+        size_t update_batch(const ItemList& items, ucharptr_c keys, ucharptr_c vals, DhtResult *results);
+        void   find_batch_nolock(const ItemList& items, ucharptr_c keys, std::vector<long>& recnos);
+        void   prefetch(const ItemList& items, ucharptr_c keys);
+
+        static ucharptr get_file_buff(unsigned which = 0);
 
         off_t search_nolock(ucharptr_c key, ucharptr val = nullptr);
         bool  append_nolock(ucharptr_c key, ucharptr_c val = nullptr);
         bool  update_nolock(ucharptr_c key, ucharptr_c val = nullptr);
+        bool  rewrite_nolock(off_t pos, ucharptr_c key, ucharptr_c val);
+
+        bool  flush();
+        bool  flush_nolock();
+
+        bool  read_full(int fd, void *dst, size_t len, off_t pos);
+        bool  write_full(int fd, const void *src, size_t len, off_t pos);
+        bool  read_direct(bool vals, ucharptr dst, size_t len, off_t pos);
+        void  forget_blocks(bool vals, off_t pos, size_t len);
+        bool  read_at(off_t pos, size_t len, ucharptr dst, bool vals = false);
+        bool  read_val(size_t recno, ucharptr dst);
+        bool  read_recs(size_t from, size_t cnt, ucharptr dst);
+        bool  join_recs(ucharptr_c keys, size_t from, size_t cnt, ucharptr dst);
+        bool  write_rec(off_t pos, ucharptr_c key, ucharptr_c val);
+        template <class F>
+        bool  write_at(off_t pos, size_t len, F fill, bool vals);
+        void  fill_rec(ucharptr dst, ucharptr_c key, ucharptr_c val);
+        void  fill_val(ucharptr dst, ucharptr_c val);
+        template <class F>
+        bool  scan_nolock(size_t from, F fn);
+        template <class F>
+        bool  scan_blocks_nolock(size_t from, F fn);
+        ucharptr map_nolock(size_t len);
+        void  unmap();
+
+        bool  index_load();
+        bool  index_rebuild(size_t capacity);
+        bool  index_add(uint64_t hash, size_t recno);
+        long  index_find(ucharptr_c key, uint64_t hash);
+        bool  index_write_header();
+        std::string index_fspec() const { return _fspec + ".idx"; }
+        static uint64_t key_hash(ucharptr_c key, size_t keylen);
+
+        bool  is_dead(size_t recno) const {
+            return _dead_cnt.load( std::memory_order_relaxed ) != 0
+                && ( recno >> 6 ) < _dead.size()
+                && ( _dead[ recno >> 6 ] >> ( recno & 63 ) & 1 ) != 0;
+        }
+        void  set_dead(size_t recno);
+        size_t live() const { return _reccnt - _dead_cnt; }
+        void  log_rewrite(size_t recno) {
+            if ( _compacting )
+                _compact_log.push_back( recno );
+        }
+        bool  dead_load(uint64_t ino);
+        bool  dead_save();
+        std::string dead_fspec() const { return _fspec + ".del"; }
+        std::string val_fspec() const { return _fspec + ".val"; }
+        void  recover_vals();
+
+        typedef std::function<bool(size_t bytes)> PaceFunc;
+        bool  compact_due(double min_ratio) const {
+            return ( _dead_cnt != 0 && _dead_cnt >= min_ratio * _reccnt )
+                || ( _max_runs != 0 && _run_cnt > _max_runs );
+        }
+        bool  compact(const PaceFunc& pace);
+        bool  swap_in(const std::string *tmp_fspec, size_t cols, size_t kept, std::vector<uint64_t>& dead, size_t dead_cnt);
+
+        DhtBucketStats stats();
+
+        bool  bloom_load();
+        bool  bloom_rebuild(size_t capacity);
+        bool  bloom_save();
+        std::string bloom_fspec() const { return _fspec + ".blm"; }
+
+        void  fp_rebuild();
+        long  fp_find(ucharptr_c key, uint64_t hash, ucharptr val = nullptr);
+
+        size_t run_block() const;
+        void  run_rebuild();
+        void  run_flushed(const std::vector<size_t>& order, std::vector<uint64_t>&& fence);
+        long  run_find(ucharptr_c key, uint64_t hash, ucharptr val = nullptr);
+        bool  merge(const PaceFunc& pace);
     };
 
 public:
     typedef std::shared_ptr<BucketFile>          BucketFilePtr;
-    typedef std::map<std::string, BucketFilePtr> BucketFilePtrMap;
-    typedef BucketFilePtrMap::const_iterator     BucketFilePtrMapCItr;
+    typedef std::vector<BucketFilePtr>           BucketFilePtrVec;
 
 protected:
-    BucketFilePtrMap   fp_map;
+    FilePool           fpool;      // must outlive the buckets
+    std::unique_ptr<AsyncIO> aio;  // likewise
+    std::unique_ptr<RecordCache> cache;
+    std::unique_ptr<RecordCache> blocks;   // direct I/O block cache
+    mutable BRLock     dir_lock;   // shared by operations, exclusive to split
+    BucketFilePtrVec   buckets;    // indexed by bucket id, empty if closed
     size_t             keylen;
     size_t             vallen;
     size_t             reclen;
     std::string        path;
     std::string        name;
-    size_t             reccnt;
+    std::atomic<size_t> reccnt;
     dht_comparitor     compfunc;
+    key_scan_fn        keyscan;
     dht_hasher         hashfunc;
+    DhtHashKind        hashkind;
+    DhtOptions         options;
+    size_t             base_cnt;   // linear hashing state
+    size_t             level;
+    size_t             split;
+    std::mutex         hdr_mtx;
+    std::atomic<bool>  clean;      // the manifest on disk is current
+
+    // background compaction
+    std::thread        compactor;
+    std::mutex         compact_mtx;    // one compaction pass at a time
+    std::mutex         compact_cv_mtx;
+    std::condition_variable compact_cv;
+    std::atomic<bool>  compact_stop;
+    std::atomic<unsigned> compacting; // buckets being compacted
+
+    // operation counts and latencies, and the activity of buckets
+    // since split away
+    ShardedCounters    counters;
+    DhtBucketStats     retired;
+
+    // count an operation, and time it with latency_stats
+    struct op_timer {
+        DiskHashTable& _dht;
+        DhtOp          _op;
+        std::chrono::steady_clock::time_point _t0;
+        op_timer(DiskHashTable& dht, DhtOp op);
+        ~op_timer();
+    };
+
+    // workers running search_async and insert_async
+    std::mutex         async_mtx;
+    std::unique_ptr<WorkQueue> async_ops;
 
 public:
+    // called with the outcome of an asynchronous operation
+    typedef std::function<void(DhtResult)> AsyncDone;
+
     DiskHashTable();
 
     virtual ~DiskHashTable();
@@ -114,27 +638,147 @@ public:
         size_t             key_len,
         size_t             val_len = 0,
         dht_comparitor     comp_func = default_comparitor,
-        dht_hasher         hash_func = default_hasher);
+        dht_hasher         hash_func = default_hasher,
+        const DhtOptions&  opts = DhtOptions());
+    bool close();
+    bool checkpoint();
 
     size_t size() const {return reccnt;}
+    size_t bucket_count();
+    FilePoolStats file_stats() { return fpool.stats(); }
+    DhtBloomStats bloom_stats();
+    RecordCacheStats cache_stats();
+    DhtStats stats(bool per_bucket = false);
+    void reset_stats();
     bool search(ucharptr_c key, ucharptr val = nullptr);
     bool insert(ucharptr_c key, ucharptr_c val = nullptr);
     bool append(ucharptr_c key, ucharptr_c val = nullptr);
     bool update(ucharptr_c key, ucharptr_c val = nullptr);
+    bool erase(ucharptr_c key);
+    // One pass over the bucket under one lock: upsert inserts key or
+    // overwrites its value (DHT_INSERTED or DHT_UPDATED); find_or_insert
+    // copies an existing value to existing (DHT_FOUND) or inserts key
+    // (DHT_INSERTED). Either gives DHT_ERROR if the write fails.
+    DhtResult upsert(ucharptr_c key, ucharptr_c val = nullptr);
+    DhtResult find_or_insert(ucharptr_c key, ucharptr_c val = nullptr, ucharptr existing = nullptr);
+    bool flush();
+    size_t compact(double min_ratio = 0);
+
+    // Queue a search or find_or_insert and return at once; done( result )
+    // is called from a worker thread when it completes (DHT_FOUND or
+    // DHT_MISSING for a search). Key and value are copied, but val must
+    // stay valid until a search is done. wait_async() waits for all of
+    // them; close() does too.
+    void search_async(ucharptr_c key, ucharptr val, AsyncDone done);
+    void insert_async(ucharptr_c key, ucharptr_c val, AsyncDone done);
+    void wait_async();
+    void scan_parallel(const BlockFunc& fn, unsigned threads = 0);
+    DhtVerifyStats verify(unsigned threads = 0);
+
+    // Batch forms of the above over n contiguous keys (and values, which
+    // may be null). Keys are grouped by bucket so each bucket is locked
+    // and scanned once per batch. results[i] receives the outcome for
+    // key i; the return is the number found, inserted or updated.
+    size_t search_batch(size_t n, ucharptr_c keys, ucharptr   vals, DhtResult *results);
+    size_t insert_batch(size_t n, ucharptr_c keys, ucharptr_c vals, DhtResult *results);
+    size_t update_batch(size_t n, ucharptr_c keys, ucharptr_c vals, DhtResult *results);
+
+    // prefetch hints the kernel to start reading what looking up the n
+    // keys will read, and returns at once. search_many is search_batch
+    // with the reads of the next few buckets hinted while each bucket
+    // is searched, so that they are in flight rather than waited for in
+    // turn. The hints are a system call or so a key, a loss when the
+    // buckets are cached already. With direct I/O there is no page
+    // cache to read into, and prefetch does nothing.
+    void   prefetch(size_t n, ucharptr_c keys);
+    size_t search_many(size_t n, ucharptr_c keys, ucharptr vals, DhtResult *results);
 
     static std::string get_bucket_fspec(
         const std::string path,
         const std::string base,
         const std::string bucket,
         bool *exists = nullptr);
+    static std::string bucket_name( size_t bucket );
 
 private:
-    std::string calc_bucket_id( ucharptr_c key );
-    BucketFilePtr get_bucket( const std::string& bucket, bool must_exist = false );
-    std::string get_bucket_fspec( const std::string& bucket, bool* exists = nullptr );
+    size_t calc_bucket_id( ucharptr_c key );
+    size_t bucket_for_hash( uint64_t hash ) const;
+    typedef std::map<size_t, BucketFile::ItemList> BucketGroups;
+    BucketGroups group_by_bucket( size_t n, ucharptr_c keys );
+    BucketFilePtr load_bucket( size_t bucket, long rec_cnt = -1, long dead_cnt = -1 );
+    std::string get_bucket_fspec( size_t bucket, bool* exists = nullptr );
+    bool read_header( TableHeader& hdr, std::vector<uint64_t>& counts );
+    bool write_header( bool with_counts = false );
+    void mark_dirty();
+    bool split_due( size_t bucket );
+    void maybe_split( size_t bucket );
+    bool split_next();
+    size_t compact_pass( double min_ratio, size_t bytes_per_sec );
+    void compact_loop();
+    void stop_compactor();
+    void drain_async();
 protected:
+    virtual key_scan_fn key_scanner( size_t key_len );
+public:
     static bool default_comparitor( const void * lhs, const void * rhs, size_t keylen );
-    static std::string default_hasher(const void * key, size_t keylen, size_t hashlen );
+    static uint64_t default_hasher( const void * key, size_t keylen );
+    static uint64_t md5_hasher( const void * key, size_t keylen );
+};
+
+// Builds a new table from records in any order, far faster than
+// appending them one by one. Records are gathered by hash into
+// BUILD_PARTS partitions, spilled to a scratch file a run at a time
+// whenever mem_bytes of them are held, and at finish() each bucket file
+// is written start to end, followed by its index and Bloom filter if
+// the options ask for them. As with append(), keys are not checked for
+// duplicates. The bucket count is the options' bucket_count, raised if
+// need be so buckets start at most half split_threshold full.
+#define BUILD_PARTS 256
+#define BUILD_MEM   (256*1024*1024)
+
+class DhtBuilder
+{
+private:
+    std::string        path;
+    std::string        dir;        // path/name/
+    std::string        name;
+    size_t             keylen;
+    size_t             vallen;
+    size_t             reclen;
+    dht_comparitor     compfunc;
+    dht_hasher         hashfunc;
+    DhtOptions         options;
+    size_t             mem_bytes;
+    std::vector<std::vector<uchar>> runs;  // records held, by partition
+    size_t             held;               // bytes in runs
+    uint64_t           count;
+    int                spill_fd;
+    off_t              spill_len;
+    std::vector<std::vector<off_t>> spilled;   // per run, where each partition starts
+    bool               building;
+    bool               ok;
+
+public:
+    DhtBuilder();
+    ~DhtBuilder();      // abandons an unfinished build
+
+    bool open(
+        const std::string  path_name,
+        const std::string  base_name,
+        size_t             key_len,
+        size_t             val_len = 0,
+        dht_comparitor     comp_func = DiskHashTable::default_comparitor,
+        dht_hasher         hash_func = DiskHashTable::default_hasher,
+        const DhtOptions&  opts = DhtOptions(),
+        size_t             max_mem = BUILD_MEM);
+    bool add(ucharptr_c key, ucharptr_c val = nullptr);
+    bool finish();      // the table can then be opened as usual
+    uint64_t size() const { return count; }
+
+private:
+    bool spill();
+    void discard();
+    std::string spill_fspec() const { return dir + name + ".spill"; }
 };
 
 template <class K, class V = NAUGHT_TYPE>
@@ -143,33 +787,79 @@ class dht : public DiskHashTable
 public:
     typedef std::pair<K,V> KeyVal;
 
+    // Walks the table bucket by bucket, reading each bucket in blocks
+    // of about DHT_ITER_BLOCK bytes rather than a record at a time.
     class iterator {
         friend dht;
     public:
         using iterator_category = std::bidirectional_iterator_tag;
         using value_type        = KeyVal;
-        using difference_type   = KeyVal;
+        using difference_type   = std::ptrdiff_t;
         using pointer           = KeyVal*;
         using reference         = KeyVal&;
     private:
-        BucketFilePtrMap&    _map;
-        BucketFilePtrMapCItr _buck;
-        long                 _recno;
+        BucketFilePtrVec&    _vec;
+        size_t               _buck;
+        size_t               _recno;
+        size_t               _first;    // the block holds records _first.._first+_cnt-1
+        size_t               _cnt;
+
+        struct Block {
+            std::vector<uchar> _recs;
+            std::vector<bool>  _dead;   // empty if none are
+        };
+        std::shared_ptr<Block> _blk;
+
+        size_t block_recs() const {
+            return std::max<size_t>( 1, DHT_ITER_BLOCK / _vec[_buck]->_reclen );
+        }
+
+        void load( size_t first ) {
+            // a copy of this iterator may still be reading the old block
+            if ( !_blk || _blk.use_count() > 1 )
+                _blk = std::make_shared<Block>();
+            _blk->_recs.resize( block_recs() * _vec[_buck]->_reclen );
+            _first = first;
+            _cnt   = _vec[_buck]->read_block( first, block_recs(), _blk->_recs.data(), &_blk->_dead );
+        }
+
+        bool dead() const {
+            return !_blk->_dead.empty() && _blk->_dead[ _recno - _first ];
+        }
+
+        // move forward to a live record, or to end()
+        void settle() {
+            while ( _buck < _vec.size() ) {
+                if ( _recno >= _first && _recno < _first + _cnt ) {
+                    if ( !dead() )
+                        return;
+                    ++_recno;
+                    continue;
+                }
+                if ( _recno < _vec[_buck]->_reccnt ) {
+                    load( _recno );
+                    if ( _cnt != 0 )
+                        continue;
+                }
+                ++_buck;
+                _recno = _first = _cnt = 0;
+            }
+            _recno = _first = _cnt = 0;
+        }
     public:
-        explicit iterator(BucketFilePtrMap& map, BucketFilePtrMapCItr pos)
-        :_map{map}       
+        explicit iterator(BucketFilePtrVec& vec, size_t pos)
+        :_vec{vec}
         ,_buck{pos}
         ,_recno{0}
-        {};
+        ,_first{0}
+        ,_cnt{0}
+        {
+            settle();
+        };
         iterator& operator++() {
-            if ( _buck != _map.cend() ) {
-                auto& buck = _buck->second;
-                if (_recno < buck->_reccnt) {
-                    ++_recno;
-                } else {
-                    ++_buck;
-                    _recno = 0;
-                }
+            if ( _buck < _vec.size() ) {
+                ++_recno;
+                settle();
             }
             return *this;
         }
@@ -179,21 +869,37 @@ public:
             return itr;
         };
         iterator& operator--() {
-            if ( _buck != _map.cbegin() ) {
-                auto& buck = _buck->second;
-                if ( _recno == 0 ) {
-                    --_buck;
-                    _recno = buck->_reccnt;
-                } else {
+            size_t buck  = _buck;
+            size_t recno = _recno;
+            do {
+                if ( _buck < _vec.size() && _recno != 0 ) {
                     --_recno;
+                } else {
+                    size_t prev = _buck;
+                    while ( prev > 0 && _vec[--prev]->_reccnt == 0 )
+                        ;
+                    if ( prev == _buck || _vec[prev]->_reccnt == 0 ) {
+                        // nothing live before here - stay put
+                        _buck  = buck;
+                        _recno = recno;
+                        _cnt   = 0;
+                        settle();
+                        return *this;
+                    }
+                    _buck  = prev;
+                    _recno = _vec[prev]->_reccnt - 1;
+                    _cnt   = 0;
                 }
-            }
+                // walking backwards, so load the block that ends here
+                if ( _recno < _first || _recno >= _first + _cnt )
+                    load( ( _recno + 1 > block_recs() ) ? _recno + 1 - block_recs() : 0 );
+            } while ( _cnt != 0 && dead() );
             return *this;
         }
         iterator operator--(int) {
             iterator itr = *this;
             --(*this);
-            return *this;
+            return itr;
         }
         bool operator==(const iterator& other) const {
             return _buck == other._buck && _recno == other._recno;
@@ -201,24 +907,56 @@ public:
         bool operator!=(const iterator& other) const { return !(*this == other); }
         KeyVal operator*() const {
             KeyVal ret;
-            _buck->second->read(_recno, (ucharptr)&ret.first, (ucharptr)&ret.second);
+            ucharptr p = _blk->_recs.data() + ( _recno - _first ) * _vec[_buck]->_reclen;
+            std::memcpy( (void*)&ret.first, p, sizeof(K) );
+            if ( _vec[_buck]->_vallen != 0 )
+                std::memcpy( (void*)&ret.second, p + sizeof(K), _vec[_buck]->_vallen );
             return ret;
         };
     };
 
-    iterator begin() { return iterator{ fp_map, fp_map.cbegin() }; };
-    iterator end()   { return iterator{ fp_map, fp_map.cend()   }; };
+    iterator begin() { return iterator{ buckets, 0 }; };
+    iterator end()   { return iterator{ buckets, buckets.size() }; };
+
+    // Call fn( const KeyVal& ) for every record, with the buckets spread
+    // over threads workers (0 for one per core). fn runs on several
+    // threads at once and must not call back into this table.
+    template <class F>
+    void for_each_parallel(F fn, unsigned threads = 0)
+    {
+        size_t vsize = (typeid(V) == typeid(NAUGHT_TYPE)) ? 0 : sizeof(V);
+        DiskHashTable::scan_parallel( [&]( ucharptr_c recs, size_t cnt ) {
+            ucharptr p = recs;
+            for ( size_t i(0); i < cnt; ++i, p += sizeof(K) + vsize ) {
+                KeyVal kv;
+                std::memcpy( (void*)&kv.first, p, sizeof(K) );
+                if ( vsize != 0 )
+                    std::memcpy( (void*)&kv.second, p + sizeof(K), vsize );
+                fn( static_cast<const KeyVal&>( kv ) );
+            }
+        }, threads );
+    }
 
     dht(
         const std::string  path_name,
         const std::string  base_name,
         dht_comparitor     comp_func = default_comparitor,
-        dht_hasher         hash_func = default_hasher
+        dht_hasher         hash_func = default_hasher,
+        const DhtOptions&  opts = DhtOptions()
     ) {
         size_t vsize = (typeid(V) == typeid(NAUGHT_TYPE)) ? 0 : sizeof(V);
-        DiskHashTable::open(path_name, base_name, sizeof(K), vsize, comp_func, hash_func);
+        DiskHashTable::open(path_name, base_name, sizeof(K), vsize, comp_func, hash_func, opts);
     }
 
+protected:
+    key_scan_fn key_scanner( size_t key_len ) override
+    {
+        if ( key_len == sizeof(K) )
+            return key_scan_for<sizeof(K)>();
+        return DiskHashTable::key_scanner( key_len );
+    }
+
+public:
     bool search(K& key)
     {
         return DiskHashTable::search((ucharptr_c)&key, nullptr);
@@ -251,6 +989,67 @@ public:
     {
         return DiskHashTable::update((ucharptr_c)&key, (ucharptr_c)&val);
     }
+    bool erase(K& key)
+    {
+        return DiskHashTable::erase((ucharptr_c)&key);
+    }
+    DhtResult upsert(K& key, V& val)
+    {
+        return DiskHashTable::upsert((ucharptr_c)&key, (ucharptr_c)&val);
+    }
+    DhtResult find_or_insert(K& key)
+    {
+        return DiskHashTable::find_or_insert((ucharptr_c)&key, nullptr, nullptr);
+    }
+    DhtResult find_or_insert(K& key, V& val, V& existing)
+    {
+        return DiskHashTable::find_or_insert((ucharptr_c)&key, (ucharptr_c)&val, (ucharptr)&existing);
+    }
+    void search_async(K& key, V& val, AsyncDone done)
+    {
+        DiskHashTable::search_async((ucharptr_c)&key, (ucharptr)&val, std::move(done));
+    }
+    void insert_async(K& key, AsyncDone done)
+    {
+        DiskHashTable::insert_async((ucharptr_c)&key, nullptr, std::move(done));
+    }
+    void insert_async(K& key, V& val, AsyncDone done)
+    {
+        DiskHashTable::insert_async((ucharptr_c)&key, (ucharptr_c)&val, std::move(done));
+    }
+
+    size_t search_batch(std::span<const K> keys, std::span<DhtResult> results)
+    {
+        return DiskHashTable::search_batch(keys.size(), (ucharptr_c)keys.data(), nullptr, results.data());
+    }
+    size_t search_batch(std::span<const K> keys, std::span<V> vals, std::span<DhtResult> results)
+    {
+        return DiskHashTable::search_batch(keys.size(), (ucharptr_c)keys.data(), (ucharptr)vals.data(), results.data());
+    }
+    void prefetch(std::span<const K> keys)
+    {
+        DiskHashTable::prefetch(keys.size(), (ucharptr_c)keys.data());
+    }
+    size_t search_many(std::span<const K> keys, std::span<DhtResult> results)
+    {
+        return DiskHashTable::search_many(keys.size(), (ucharptr_c)keys.data(), nullptr, results.data());
+    }
+    size_t search_many(std::span<const K> keys, std::span<V> vals, std::span<DhtResult> results)
+    {
+        return DiskHashTable::search_many(keys.size(), (ucharptr_c)keys.data(), (ucharptr)vals.data(), results.data());
+    }
+    size_t insert_batch(std::span<const K> keys, std::span<DhtResult> results)
+    {
+        return DiskHashTable::insert_batch(keys.size(), (ucharptr_c)keys.data(), nullptr, results.data());
+    }
+    size_t insert_batch(std::span<const K> keys, std::span<const V> vals, std::span<DhtResult> results)
+    {
+        return DiskHashTable::insert_batch(keys.size(), (ucharptr_c)keys.data(), (ucharptr_c)vals.data(), results.data());
+    }
+    size_t update_batch(std::span<const K> keys, std::span<const V> vals, std::span<DhtResult> results)
+    {
+        return DiskHashTable::update_batch(keys.size(), (ucharptr_c)keys.data(), (ucharptr_c)vals.data(), results.data());
+    }
 };
 
 } // namespace libcf
\ No newline at end of file
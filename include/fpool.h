@@ -0,0 +1,73 @@
+// fpool - bounded pool of open files
+//
+// Objects that own file handles derive from PooledFile and borrow their
+// handles through a FilePool. A borrowed object is pinned and will not
+// be closed out from under its user; once released it stays open until
+// the pool needs the descriptors for someone else, at which point an
+// unpinned object that hasn't been used recently is closed (CLOCK
+// second-chance replacement).
+//
+// Borrowing an object that is already open is a single atomic update
+// on the object itself; the pool's mutex is only taken to open, close
+// or evict, so threads working on different files don't contend.
+//
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+
+namespace libcf {
+
+class FilePool;
+
+class PooledFile
+{
+    friend class FilePool;
+    std::list<PooledFile*>::iterator _lru;
+    std::atomic<int>                 _pins{-1};     // -1 closed, -2 closing, else borrowers
+    std::atomic<bool>                _touched{false};
+public:
+    virtual ~PooledFile() {}
+    virtual bool   pool_open()  = 0;
+    virtual bool   pool_close() = 0;
+    // number of descriptors this object holds while open
+    virtual size_t pool_fds() const { return 1; }
+};
+
+struct FilePoolStats
+{
+    uint64_t _opens;
+    uint64_t _closes;
+    size_t   _open_fds;
+    size_t   _capacity;
+};
+
+class FilePool
+{
+private:
+    std::mutex             _mtx;
+    std::list<PooledFile*> _lru;        // clock order, the hand at the back
+    size_t                 _capacity;   // in descriptors; 0 closes on release
+    std::atomic<size_t>    _open_fds;
+    uint64_t               _opens;
+    uint64_t               _closes;
+
+public:
+    FilePool(size_t capacity = default_capacity());
+    virtual ~FilePool();
+    void resize(size_t capacity);
+    bool borrow(PooledFile& pf);
+    void release(PooledFile& pf);
+    void forget(PooledFile& pf);
+    FilePoolStats stats();
+
+    static size_t default_capacity();
+
+private:
+    void evict_nolock(size_t want);
+    void close_nolock(PooledFile& pf);
+};
+
+} // namespace libcf
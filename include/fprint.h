@@ -0,0 +1,38 @@
+// fprint - resident arrays of short key fingerprints
+//
+// Fingerprints holds 8 or 16 bits of each record's key hash, in record
+// order. Looking a key up scans the array for its fingerprint, 16 or 32
+// bytes to a compare with SSE2 or AVX2, and only the records whose
+// fingerprint matches need reading: besides the key itself, one in 256
+// (or 65536) of the others.
+//
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace libcf {
+
+class Fingerprints
+{
+private:
+    std::vector<uint8_t> _fps;      // _width bytes per record
+    unsigned             _width;
+
+    uint16_t of(uint64_t hash) const;
+
+public:
+    // bits is rounded up to 8 or 16
+    Fingerprints(unsigned bits);
+    unsigned bits() const { return _width * 8; }
+    size_t   size() const { return _fps.size() / _width; }
+    size_t   bytes() const { return _fps.capacity(); }
+    void     reserve(size_t cnt) { _fps.reserve( cnt * _width ); }
+    void     add(uint64_t hash);
+
+    // the first record from from on whose fingerprint matches hash's,
+    // or size() if none does
+    size_t   next(uint64_t hash, size_t from) const;
+};
+
+} // namespace libcf
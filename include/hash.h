@@ -0,0 +1,16 @@
+// hash - fast non-cryptographic 64-bit hashing
+//
+// A wyhash-style hash of an arbitrary byte string. It is not meant to be
+// secure, only fast and well distributed. Different seeds give (for our
+// purposes) independent hash functions, which is how the bucket hasher
+// and the per-bucket index keep from correlating with one another.
+//
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace libcf {
+
+uint64_t hash64(const void *key, size_t len, uint64_t seed = 0);
+
+} // namespace libcf
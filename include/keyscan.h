@@ -0,0 +1,171 @@
+// keyscan - find a key in a run of fixed-length records
+//
+// A kernel returns the first of cnt records, reclen bytes apart, whose
+// leading keylen bytes equal key - what a memcmp per record would find.
+//
+// key_scan_for<KL>() picks a kernel specialized on a compile-time key
+// length, so the compares unroll into a handful of word loads. For keys
+// of 16 bytes or more, the x86 kernels test the first 16 (or 32) bytes
+// of several records per step with SSE2, or AVX2 when the CPU has it,
+// and only finish the compare on records that pass. key_scan_for(len)
+// does the same for a length known only at run time, with a generic
+// loop for lengths it has no kernel for.
+//
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace libcf {
+
+typedef size_t (*key_scan_fn)(const unsigned char *recs, size_t cnt, size_t reclen,
+                              const unsigned char *key, size_t keylen);
+
+key_scan_fn key_scan_for(size_t keylen);
+bool        key_scan_avx2();
+
+namespace keyscan {
+
+template <class T>
+inline T load(const unsigned char *p)
+{
+    T v;
+    std::memcpy( &v, p, sizeof(T) );
+    return v;
+}
+
+template <size_t KL>
+inline bool equal(const unsigned char *a, const unsigned char *b)
+{
+    size_t i = 0;
+    for ( ; i + 8 <= KL; i += 8 )
+        if ( load<uint64_t>( a + i ) != load<uint64_t>( b + i ) )
+            return false;
+    if constexpr ( KL % 8 >= 4 )
+    {
+        if ( load<uint32_t>( a + i ) != load<uint32_t>( b + i ) )
+            return false;
+        i += 4;
+    }
+    if constexpr ( KL % 4 >= 2 )
+    {
+        if ( load<uint16_t>( a + i ) != load<uint16_t>( b + i ) )
+            return false;
+        i += 2;
+    }
+    if constexpr ( KL % 2 == 1 )
+    {
+        if ( a[ i ] != b[ i ] )
+            return false;
+    }
+    return true;
+}
+
+template <size_t KL>
+size_t scan_scalar(const unsigned char *recs, size_t cnt, size_t reclen, const unsigned char *key, size_t)
+{
+    const unsigned char *p = recs;
+    for ( size_t i(0); i < cnt; ++i, p += reclen )
+        if ( equal<KL>( p, key ) )
+            return i;
+    return cnt;
+}
+
+#if defined(__x86_64__)
+
+// four records a step, comparing the first 16 bytes of each
+template <size_t KL>
+size_t scan_sse2(const unsigned char *recs, size_t cnt, size_t reclen, const unsigned char *key, size_t)
+{
+    static_assert( KL >= 16 );
+    const __m128i k = _mm_loadu_si128( (const __m128i*)key );
+    size_t i = 0;
+    for ( ; i + 4 <= cnt; i += 4 )
+    {
+        const unsigned char *p = recs + i * reclen;
+        unsigned hit = 0;
+        for ( unsigned j(0); j < 4; ++j )
+        {
+            __m128i r = _mm_loadu_si128( (const __m128i*)( p + j * reclen ) );
+            hit |= (unsigned)( _mm_movemask_epi8( _mm_cmpeq_epi8( r, k ) ) == 0xffff ) << j;
+        }
+        for ( ; hit != 0; hit &= hit - 1 )
+        {
+            unsigned j = __builtin_ctz( hit );
+            if ( equal<KL - 16>( p + j * reclen + 16, key + 16 ) )
+                return i + j;
+        }
+    }
+    for ( ; i < cnt; ++i )
+        if ( equal<KL>( recs + i * reclen, key ) )
+            return i;
+    return cnt;
+}
+
+// Eight records a step. Keys of 32 bytes or more compare their first
+// 32 bytes a record at a time; shorter ones pack the first 16 bytes of
+// two records into each compare.
+template <size_t KL>
+__attribute__((target("avx2")))
+size_t scan_avx2(const unsigned char *recs, size_t cnt, size_t reclen, const unsigned char *key, size_t)
+{
+    static_assert( KL >= 16 );
+    constexpr size_t WIDE = ( KL >= 32 ) ? 32 : 16;
+    __m256i k;
+    if constexpr ( WIDE == 32 )
+        k = _mm256_loadu_si256( (const __m256i*)key );
+    else
+        k = _mm256_broadcastsi128_si256( _mm_loadu_si128( (const __m128i*)key ) );
+    size_t i = 0;
+    for ( ; i + 8 <= cnt; i += 8 )
+    {
+        const unsigned char *p = recs + i * reclen;
+        unsigned hit = 0;
+        for ( unsigned j(0); j < 8; j += ( WIDE == 32 ) ? 1 : 2 )
+        {
+            if constexpr ( WIDE == 32 )
+            {
+                __m256i r = _mm256_loadu_si256( (const __m256i*)( p + j * reclen ) );
+                hit |= (unsigned)( (uint32_t)_mm256_movemask_epi8( _mm256_cmpeq_epi8( r, k ) ) == 0xffffffffu ) << j;
+            }
+            else
+            {
+                __m256i r = _mm256_inserti128_si256(
+                    _mm256_castsi128_si256( _mm_loadu_si128( (const __m128i*)( p + j * reclen ) ) ),
+                    _mm_loadu_si128( (const __m128i*)( p + ( j + 1 ) * reclen ) ), 1 );
+                uint32_t m = _mm256_movemask_epi8( _mm256_cmpeq_epi8( r, k ) );
+                hit |= (unsigned)( ( m & 0xffff ) == 0xffff ) << j;
+                hit |= (unsigned)( ( m >> 16 ) == 0xffff ) << ( j + 1 );
+            }
+        }
+        for ( ; hit != 0; hit &= hit - 1 )
+        {
+            unsigned j = __builtin_ctz( hit );
+            if ( equal<KL - WIDE>( p + j * reclen + WIDE, key + WIDE ) )
+                return i + j;
+        }
+    }
+    for ( ; i < cnt; ++i )
+        if ( equal<KL>( recs + i * reclen, key ) )
+            return i;
+    return cnt;
+}
+
+#endif
+
+} // namespace keyscan
+
+template <size_t KL>
+key_scan_fn key_scan_for()
+{
+#if defined(__x86_64__)
+    if constexpr ( KL >= 16 )
+        return key_scan_avx2() ? keyscan::scan_avx2<KL> : keyscan::scan_sse2<KL>;
+#endif
+    return keyscan::scan_scalar<KL>;
+}
+
+} // namespace libcf
@@ -2,7 +2,16 @@
 // general include file
 //
 #pragma once
+#include "aio.h"
+#include "bloom.h"
+#include "brlock.h"
+#include "counters.h"
 #include "dq.h"
 #include "dht.h"
 #include "dstack.h"
+#include "fpool.h"
+#include "fprint.h"
+#include "hash.h"
+#include "keyscan.h"
+#include "rcache.h"
 #include "buildinfo.h"
\ No newline at end of file
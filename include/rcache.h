@@ -0,0 +1,67 @@
+// rcache - bounded cache of fixed-length key/value records
+//
+// Sits in front of a slower store to answer repeat lookups of hot keys.
+// Entries are spread over independently locked shards by key hash, and
+// each shard evicts with CLOCK: a hit marks an entry referenced, and the
+// hand passes over referenced entries once before reclaiming them.
+//
+// The cache only holds what it is given; keeping it coherent with the
+// store behind it is up to the caller.
+//
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace libcf {
+
+struct RecordCacheStats
+{
+    size_t   _capacity;
+    size_t   _entries;
+    uint64_t _hits;
+    uint64_t _misses;
+};
+
+class RecordCache
+{
+private:
+    struct alignas(64) Shard
+    {
+        std::mutex            _mtx;
+        std::vector<uint32_t> _tab;     // open-addressed, slot + 1 or 0 if free
+        std::vector<uint64_t> _hash;    // per slot
+        std::vector<uint8_t>  _ref;     // per slot, set by a hit
+        std::vector<uint8_t>  _recs;    // per slot, key then value
+        size_t                _cnt  = 0;
+        size_t                _hand = 0;
+        uint64_t              _hits   = 0;
+        uint64_t              _misses = 0;
+    };
+
+    size_t                   _keylen;
+    size_t                   _vallen;
+    size_t                   _reclen;
+    size_t                   _shard_cap;    // slots per shard
+    size_t                   _shard_cnt;    // a power of two
+    std::unique_ptr<Shard[]> _shards;
+
+public:
+    RecordCache(size_t capacity, size_t keylen, size_t vallen);
+    bool get(const void *key, void *val);
+    void put(const void *key, const void *val);
+    void refresh(const void *key, const void *val);
+    void erase(const void *key);
+    RecordCacheStats stats();
+
+private:
+    uint64_t hash(const void *key) const;
+    Shard&   shard(uint64_t hash) { return _shards[ hash >> 58 & ( _shard_cnt - 1 ) ]; }
+    size_t   find(Shard& s, uint64_t hash) const;
+    void     remove(Shard& s, size_t pos);
+    void     store(Shard& s, size_t slot, const void *key, const void *val);
+};
+
+} // namespace libcf
@@ -0,0 +1,388 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "aio.h"
+
+namespace libcf {
+
+#define AIO_MAX_DEPTH   4096
+#define AIO_MAX_THREADS 128         // thread pool fallback
+#define RING_STOP       (~0ull)     // user_data of the reaper's wake-up call
+
+//////////////////////////////////////////////////////////////////////////////
+// WorkQueue
+//
+WorkQueue::WorkQueue(unsigned threads)
+: _busy(0)
+, _stop(false)
+{
+    for ( unsigned i(0); i < std::max( 1u, threads ); ++i )
+        _threads.emplace_back( &WorkQueue::run, this );
+}
+
+WorkQueue::~WorkQueue()
+{
+    {
+        std::lock_guard<std::mutex> lock( _mtx );
+        _stop = true;
+    }
+    _cv.notify_all();
+    for ( auto& t : _threads )
+        t.join();
+}
+
+void WorkQueue::push(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock( _mtx );
+        _jobs.push_back( std::move( job ) );
+    }
+    _cv.notify_one();
+}
+
+// wait until nothing is queued or running
+void WorkQueue::wait()
+{
+    std::unique_lock<std::mutex> lock( _mtx );
+    _idle.wait( lock, [&]{ return _jobs.empty() && _busy == 0; } );
+}
+
+void WorkQueue::run()
+{
+    std::unique_lock<std::mutex> lock( _mtx );
+    while ( true )
+    {
+        _cv.wait( lock, [&]{ return _stop || !_jobs.empty(); } );
+        if ( _jobs.empty() )
+            return;
+        std::function<void()> job = std::move( _jobs.front() );
+        _jobs.pop_front();
+        _busy++;
+        lock.unlock();
+        job();
+        lock.lock();
+        if ( --_busy == 0 && _jobs.empty() )
+            _idle.notify_all();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// AsyncIO
+//
+// The io_uring is driven through the raw system calls: submissions are
+// written to the shared submission ring under _mtx, and a reaper thread
+// sleeps in io_uring_enter for completions and runs their callbacks.
+//
+struct AsyncIO::Ring
+{
+    int            _fd     = -1;
+    void          *_sq_map = MAP_FAILED;
+    size_t         _sq_len = 0;
+    void          *_cq_map = MAP_FAILED;
+    size_t         _cq_len = 0;
+    io_uring_sqe  *_sqes   = (io_uring_sqe *)MAP_FAILED;
+    size_t         _sqes_len = 0;
+    unsigned      *_sq_head;
+    unsigned      *_sq_tail;
+    unsigned      *_sq_mask;
+    unsigned      *_sq_array;
+    unsigned      *_cq_head;
+    unsigned      *_cq_tail;
+    unsigned      *_cq_mask;
+    io_uring_cqe  *_cqes;
+    unsigned       _pending = 0;        // queued, not yet handed to the kernel
+    std::vector<Callback> _slots;       // by user_data
+    std::vector<unsigned> _free;
+    std::thread    _reaper;
+
+    ~Ring()
+    {
+        if ( _sqes != MAP_FAILED )
+            munmap( _sqes, _sqes_len );
+        if ( _cq_map != MAP_FAILED && _cq_map != _sq_map )
+            munmap( _cq_map, _cq_len );
+        if ( _sq_map != MAP_FAILED )
+            munmap( _sq_map, _sq_len );
+        if ( _fd != -1 )
+            ::close( _fd );
+    }
+};
+
+AsyncIO::AsyncIO(unsigned depth, bool use_uring)
+: _depth( std::clamp( depth, 1u, (unsigned)AIO_MAX_DEPTH ) )
+, _in_flight(0)
+{
+    if ( !use_uring || !ring_setup() )
+        _pool = std::make_unique<WorkQueue>( std::min( _depth, (unsigned)AIO_MAX_THREADS ) );
+}
+
+AsyncIO::~AsyncIO()
+{
+    {
+        std::unique_lock<std::mutex> lock( _mtx );
+        _room.wait( lock, [&]{ return _in_flight == 0; } );
+    }
+    if ( _ring )
+        ring_close();
+    _pool.reset();
+}
+
+void AsyncIO::read(int fd, void *buf, size_t len, off_t pos, Callback cb, bool more)
+{
+    submit( false, fd, buf, len, pos, std::move( cb ), more );
+}
+
+void AsyncIO::write(int fd, const void *buf, size_t len, off_t pos, Callback cb, bool more)
+{
+    submit( true, fd, const_cast<void *>( buf ), len, pos, std::move( cb ), more );
+}
+
+void AsyncIO::submit(bool write, int fd, void *buf, size_t len, off_t pos, Callback cb, bool more)
+{
+    std::unique_lock<std::mutex> lock( _mtx );
+    if ( _in_flight >= _depth )
+    {
+        // anything held back to go with this has to go now
+        if ( _ring && _ring->_pending != 0 )
+            ring_enter();
+        _room.wait( lock, [&]{ return _in_flight < _depth; } );
+    }
+    _in_flight++;
+
+    if ( !_ring )
+    {
+        lock.unlock();
+        _pool->push( [=, this, cb = std::move( cb )] {
+            ssize_t res = write ? ::pwrite( fd, buf, len, pos ) : ::pread( fd, buf, len, pos );
+            cb( ( res < 0 ) ? -errno : res );
+            {
+                std::lock_guard<std::mutex> lock( _mtx );
+                _in_flight--;
+            }
+            _room.notify_all();
+        });
+        return;
+    }
+
+    Ring& r = *_ring;
+    unsigned slot = r._free.back();
+    r._free.pop_back();
+    r._slots[ slot ] = std::move( cb );
+    unsigned tail = *r._sq_tail;
+    unsigned idx  = tail & *r._sq_mask;
+    io_uring_sqe& sqe = r._sqes[ idx ];
+    std::memset( &sqe, 0, sizeof(sqe) );
+    sqe.opcode    = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe.fd        = fd;
+    sqe.addr      = (uint64_t)buf;
+    sqe.len       = len;
+    sqe.off       = pos;
+    sqe.user_data = slot;
+    r._sq_array[ idx ] = idx;
+    __atomic_store_n( r._sq_tail, tail + 1, __ATOMIC_RELEASE );
+    r._pending++;
+    if ( !more )
+        ring_enter();
+}
+
+bool AsyncIO::ring_setup()
+{
+    io_uring_params params;
+    std::memset( &params, 0, sizeof(params) );
+    auto r = std::make_unique<Ring>();
+    r->_fd = syscall( __NR_io_uring_setup, _depth, &params );
+    if ( r->_fd < 0 )
+    {
+        r->_fd = -1;
+        return false;
+    }
+    r->_sq_len   = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->_cq_len   = params.cq_off.cqes  + params.cq_entries * sizeof(io_uring_cqe);
+    r->_sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+    bool single  = ( params.features & IORING_FEAT_SINGLE_MMAP ) != 0;
+    if ( single )
+        r->_sq_len = r->_cq_len = std::max( r->_sq_len, r->_cq_len );
+    r->_sq_map = mmap( nullptr, r->_sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->_fd, IORING_OFF_SQ_RING );
+    if ( r->_sq_map == MAP_FAILED )
+        return false;
+    r->_cq_map = single ? r->_sq_map
+                        : mmap( nullptr, r->_cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->_fd, IORING_OFF_CQ_RING );
+    if ( r->_cq_map == MAP_FAILED )
+        return false;
+    r->_sqes = (io_uring_sqe *)mmap( nullptr, r->_sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->_fd, IORING_OFF_SQES );
+    if ( r->_sqes == MAP_FAILED )
+        return false;
+
+    uint8_t *sq = (uint8_t *)r->_sq_map;
+    uint8_t *cq = (uint8_t *)r->_cq_map;
+    r->_sq_head  = (unsigned *)( sq + params.sq_off.head );
+    r->_sq_tail  = (unsigned *)( sq + params.sq_off.tail );
+    r->_sq_mask  = (unsigned *)( sq + params.sq_off.ring_mask );
+    r->_sq_array = (unsigned *)( sq + params.sq_off.array );
+    r->_cq_head  = (unsigned *)( cq + params.cq_off.head );
+    r->_cq_tail  = (unsigned *)( cq + params.cq_off.tail );
+    r->_cq_mask  = (unsigned *)( cq + params.cq_off.ring_mask );
+    r->_cqes     = (io_uring_cqe *)( cq + params.cq_off.cqes );
+    r->_slots.resize( _depth );
+    for ( unsigned i(_depth); i > 0; --i )
+        r->_free.push_back( i - 1 );
+    _ring = std::move( r );
+    _ring->_reaper = std::thread( &AsyncIO::ring_reap, this );
+    return true;
+}
+
+// Hand queued submissions to the kernel; call with _mtx held. Should
+// the ring fail, whatever it didn't take completes with the error.
+bool AsyncIO::ring_enter()
+{
+    Ring& r = *_ring;
+    while ( r._pending != 0 )
+    {
+        int n = syscall( __NR_io_uring_enter, r._fd, r._pending, 0, 0, nullptr, 0 );
+        if ( n > 0 )
+        {
+            r._pending -= n;
+            continue;
+        }
+        if ( n < 0 && errno == EINTR )
+            continue;
+        int err = ( n < 0 ) ? errno : EAGAIN;
+        std::cout << "Error submitting to io_uring " << err << std::endl;
+        unsigned head = __atomic_load_n( r._sq_head, __ATOMIC_ACQUIRE );
+        unsigned tail = *r._sq_tail;
+        __atomic_store_n( r._sq_tail, head, __ATOMIC_RELEASE );
+        r._pending = 0;
+        for ( ; head != tail; ++head )
+        {
+            unsigned slot = r._sqes[ r._sq_array[ head & *r._sq_mask ] ].user_data;
+            if ( slot >= r._slots.size() )
+                continue;
+            Callback cb = std::move( r._slots[ slot ] );
+            r._free.push_back( slot );
+            _in_flight--;
+            cb( -err );
+        }
+        _room.notify_all();
+        return false;
+    }
+    return true;
+}
+
+void AsyncIO::ring_reap()
+{
+    Ring& r = *_ring;
+    for ( bool stop = false; !stop; )
+    {
+        syscall( __NR_io_uring_enter, r._fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0 );
+        unsigned head = *r._cq_head;
+        unsigned tail = __atomic_load_n( r._cq_tail, __ATOMIC_ACQUIRE );
+        for ( ; head != tail; ++head )
+        {
+            io_uring_cqe cqe = r._cqes[ head & *r._cq_mask ];
+            __atomic_store_n( r._cq_head, head + 1, __ATOMIC_RELEASE );
+            if ( cqe.user_data == RING_STOP )
+            {
+                stop = true;
+                continue;
+            }
+            Callback cb;
+            {
+                std::lock_guard<std::mutex> lock( _mtx );
+                cb = std::move( r._slots[ cqe.user_data ] );
+                r._free.push_back( cqe.user_data );
+            }
+            cb( cqe.res );
+            {
+                std::lock_guard<std::mutex> lock( _mtx );
+                _in_flight--;
+            }
+            _room.notify_all();
+        }
+    }
+}
+
+// wake the reaper with a no-op it knows to stop at
+void AsyncIO::ring_close()
+{
+    {
+        std::lock_guard<std::mutex> lock( _mtx );
+        Ring& r = *_ring;
+        unsigned tail = *r._sq_tail;
+        unsigned idx  = tail & *r._sq_mask;
+        std::memset( &r._sqes[ idx ], 0, sizeof(io_uring_sqe) );
+        r._sqes[ idx ].opcode    = IORING_OP_NOP;
+        r._sqes[ idx ].user_data = RING_STOP;
+        r._sq_array[ idx ] = idx;
+        __atomic_store_n( r._sq_tail, tail + 1, __ATOMIC_RELEASE );
+        r._pending++;
+        ring_enter();
+    }
+    _ring->_reaper.join();
+    _ring.reset();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// AioBatch
+//
+AioBatch::AioBatch()
+: _left(0)
+, _ok(true)
+{}
+
+AioBatch::~AioBatch()
+{
+    wait();
+}
+
+void AioBatch::read(AsyncIO& aio, int fd, void *buf, size_t len, off_t pos)
+{
+    transfer( aio, false, fd, (uint8_t *)buf, len, pos );
+}
+
+void AioBatch::write(AsyncIO& aio, int fd, const void *buf, size_t len, off_t pos)
+{
+    transfer( aio, true, fd, (uint8_t *)buf, len, pos );
+}
+
+void AioBatch::transfer(AsyncIO& aio, bool write, int fd, uint8_t *buf, size_t len, off_t pos)
+{
+    while ( len > 0 )
+    {
+        size_t n = std::min<size_t>( len, AIO_PIECE );
+        {
+            std::lock_guard<std::mutex> lock( _mtx );
+            _left++;
+        }
+        // notify under the lock - the batch may be gone once it's dropped
+        auto done = [this, n]( ssize_t res ) {
+            std::lock_guard<std::mutex> lock( _mtx );
+            if ( res != (ssize_t)n )
+                _ok = false;
+            if ( --_left == 0 )
+                _cv.notify_all();
+        };
+        if ( write )
+            aio.write( fd, buf, n, pos, done, len > n );
+        else
+            aio.read( fd, buf, n, pos, done, len > n );
+        buf += n;
+        pos += n;
+        len -= n;
+    }
+}
+
+bool AioBatch::wait()
+{
+    std::unique_lock<std::mutex> lock( _mtx );
+    _cv.wait( lock, [&]{ return _left == 0; } );
+    bool ok = _ok;
+    _ok = true;
+    return ok;
+}
+
+} // namespace libcf
@@ -0,0 +1,102 @@
+#include <cmath>
+#include "bloom.h"
+
+namespace libcf {
+
+#define BLOOM_MAGIC     0x4d4c4244  // 'DBLM'
+#define BLOOM_VERSION   1
+#define BLOOM_MAX_HASH  16
+
+BloomFilter::BloomFilter()
+: _bits(64)
+, _hashes(1)
+, _count(0)
+, _capacity(0)
+{
+    _words.resize( 1 );
+}
+
+// size for capacity keys at the given false positive rate, unless
+// that would take more than max_bytes
+BloomFilter::BloomFilter(size_t capacity, double fpr, size_t max_bytes)
+: _count(0)
+, _capacity(capacity)
+{
+    const double ln2 = std::log( 2.0 );
+    double bits = -( capacity * std::log( fpr ) ) / ( ln2 * ln2 );
+    if ( max_bytes != 0 && bits > max_bytes * 8.0 )
+        bits = max_bytes * 8.0;
+    _bits = ( (uint64_t)bits + 63 ) / 64 * 64;
+    if ( _bits < 64 )
+        _bits = 64;
+    _hashes = (uint32_t)std::lround( (double)_bits / ( capacity ? capacity : 1 ) * ln2 );
+    if ( _hashes < 1 )
+        _hashes = 1;
+    if ( _hashes > BLOOM_MAX_HASH )
+        _hashes = BLOOM_MAX_HASH;
+    _words.resize( _bits / 64 );
+}
+
+// map a 64-bit value onto [0, n) without a division
+static inline uint64_t reduce( uint64_t x, uint64_t n )
+{
+    return (uint64_t)( ( (__uint128_t)x * n ) >> 64 );
+}
+
+void BloomFilter::add(uint64_t hash)
+{
+    uint64_t h2 = ( ( hash >> 32 ) | ( hash << 32 ) ) * 0x9e3779b97f4a7c15ull | 1;
+    for ( uint32_t i(0); i < _hashes; ++i, hash += h2 )
+    {
+        uint64_t bit = reduce( hash, _bits );
+        _words[ bit >> 6 ] |= 1ull << ( bit & 63 );
+    }
+    _count++;
+}
+
+bool BloomFilter::contains(uint64_t hash) const
+{
+    uint64_t h2 = ( ( hash >> 32 ) | ( hash << 32 ) ) * 0x9e3779b97f4a7c15ull | 1;
+    for ( uint32_t i(0); i < _hashes; ++i, hash += h2 )
+    {
+        uint64_t bit = reduce( hash, _bits );
+        if ( ( _words[ bit >> 6 ] & ( 1ull << ( bit & 63 ) ) ) == 0 )
+            return false;
+    }
+    return true;
+}
+
+// expected false positive rate at the current fill
+double BloomFilter::fpr() const
+{
+    return std::pow( 1.0 - std::exp( -(double)_hashes * _count / _bits ), _hashes );
+}
+
+bool BloomFilter::save(std::FILE *fp) const
+{
+    BloomHeader hdr{ BLOOM_MAGIC, BLOOM_VERSION, _bits, _hashes, _count, _capacity };
+    return std::fwrite( &hdr, sizeof(hdr), 1, fp ) == 1
+        && std::fwrite( _words.data(), sizeof(uint64_t), _words.size(), fp ) == _words.size();
+}
+
+bool BloomFilter::load(std::FILE *fp)
+{
+    BloomHeader hdr;
+    if ( std::fread( &hdr, sizeof(hdr), 1, fp ) != 1
+      || hdr._magic   != BLOOM_MAGIC
+      || hdr._version != BLOOM_VERSION
+      || hdr._bits == 0 || hdr._bits % 64 != 0
+      || hdr._hashes == 0 || hdr._hashes > BLOOM_MAX_HASH )
+        return false;
+    std::vector<uint64_t> words( hdr._bits / 64 );
+    if ( std::fread( words.data(), sizeof(uint64_t), words.size(), fp ) != words.size() )
+        return false;
+    _words.swap( words );
+    _bits     = hdr._bits;
+    _hashes   = hdr._hashes;
+    _count    = hdr._count;
+    _capacity = hdr._capacity;
+    return true;
+}
+
+} // namespace libcf
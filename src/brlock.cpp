@@ -0,0 +1,41 @@
+#include <atomic>
+#include "brlock.h"
+
+namespace libcf {
+
+// threads are dealt shards round robin as they first use any BRLock
+size_t BRLock::shard()
+{
+    static std::atomic<size_t> next{0};
+    thread_local size_t mine = next.fetch_add( 1, std::memory_order_relaxed ) % BRLOCK_SHARDS;
+    return mine;
+}
+
+// always in shard order, so two writers can't deadlock
+void BRLock::lock()
+{
+    for ( Shard& s : _shards )
+        s._mtx.lock();
+}
+
+bool BRLock::try_lock()
+{
+    for ( size_t i(0); i < BRLOCK_SHARDS; ++i )
+    {
+        if ( !_shards[ i ]._mtx.try_lock() )
+        {
+            while ( i-- > 0 )
+                _shards[ i ]._mtx.unlock();
+            return false;
+        }
+    }
+    return true;
+}
+
+void BRLock::unlock()
+{
+    for ( Shard& s : _shards )
+        s._mtx.unlock();
+}
+
+} // namespace libcf
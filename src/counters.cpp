@@ -0,0 +1,45 @@
+#include <bit>
+#include "counters.h"
+
+namespace libcf {
+
+#define CACHE_LINE  64
+
+ShardedCounters::ShardedCounters(size_t cnt)
+: _cnt(cnt)
+, _stride( ( cnt * sizeof(uint64_t) + CACHE_LINE - 1 ) / CACHE_LINE * CACHE_LINE / sizeof(uint64_t) )
+, _store( _stride * CTR_SHARDS + CACHE_LINE / sizeof(uint64_t) )
+{
+    size_t skew = (uintptr_t)_store.data() % CACHE_LINE;
+    _vals = _store.data() + ( skew ? ( CACHE_LINE - skew ) / sizeof(uint64_t) : 0 );
+}
+
+// threads take shards in turn as they first count
+unsigned ShardedCounters::shard()
+{
+    static std::atomic<unsigned> next{0};
+    thread_local unsigned mine = next.fetch_add( 1, std::memory_order_relaxed ) % CTR_SHARDS;
+    return mine;
+}
+
+uint64_t ShardedCounters::get(size_t i) const
+{
+    uint64_t sum(0);
+    for ( size_t s(0); s < CTR_SHARDS; ++s )
+        sum += _vals[ s * _stride + i ].load( std::memory_order_relaxed );
+    return sum;
+}
+
+void ShardedCounters::reset()
+{
+    for ( auto& v : _store )
+        v.store( 0, std::memory_order_relaxed );
+}
+
+unsigned ShardedCounters::lat_bucket(uint64_t ns)
+{
+    unsigned b = ( ns == 0 ) ? 0 : 63 - std::countl_zero( ns );
+    return ( b < LAT_BUCKETS ) ? b : LAT_BUCKETS - 1;
+}
+
+} // namespace libcf
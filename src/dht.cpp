@@ -1,129 +1,503 @@
+#include <bit>
+#include <cmath>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <queue>
+#include <unistd.h>
+#include <unordered_map>
 #include "dht.h"
 #include "md5.h"
 
 namespace libcf {
 
 #define TABLE_BUFF_SIZE 1024*1024*4 // 4 MiB
+#define MMAP_STEP       1024*1024*64    // 64 MiB
 
-std::map<size_t, BuffPtr> DiskHashTable::BucketFile::buff_map;
-// fopen is failing with errno 24 (too many files) on unlimited ulimit,
-// so postulating that I'm opening file too fast.
-std::mutex fopen_mtx;
+// bucket index sidecar
+#define INDEX_MAGIC     0x49544844  // 'DHTI'
+#define INDEX_VERSION   1
+#define INDEX_MIN_SLOTS 1024
+#define INDEX_SEED      0x1dc0ffee
+#define INDEX_PROBE     8           // slots read per probe
+
+#define BLOOM_MIN_KEYS  1024
+
+// bucket tombstone sidecar
+#define DEAD_MAGIC      0x44544844  // 'DHTD'
+#define DEAD_VERSION    1
+
+#define COMPACT_POLL_MS 1000        // background compaction looks this often
+
+#define RUN_BLOCK       4096        // bytes of a sorted run per fence
+
+#define DIRECT_CACHE_MAX 4          // blocks a direct read may take from the cache
+
+#define PREFETCH_AHEAD  4           // buckets search_many hints ahead
+
+// table header
+#define TABLE_MAGIC     0x54544844  // 'DHTT'
+#define TABLE_VERSION   3
+#define TABLE_FLAG_SPLIT_VALUES 1
+#define TABLE_FLAG_SORTED_RUNS  2
+#define MANIFEST_MAGIC  0x4e544844  // 'DHTN' - 'DHTM' lacked erased counts
+
+// pread/pwrite all of len bytes at pos - both may stop short
+static bool pread_full( int fd, void *dst, size_t len, off_t pos )
+{
+    ucharptr p = (ucharptr)dst;
+    while ( len > 0 )
+    {
+        ssize_t n = ::pread( fd, p, len, pos );
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n <= 0 )
+            return false;
+        p   += n;
+        pos += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool pwrite_full( int fd, const void *src, size_t len, off_t pos )
+{
+    const uchar *p = (const uchar *)src;
+    while ( len > 0 )
+    {
+        ssize_t n = ::pwrite( fd, p, len, pos );
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n <= 0 )
+            return false;
+        p   += n;
+        pos += n;
+        len -= n;
+    }
+    return true;
+}
+
+// pread through an O_DIRECT descriptor, buf, len and pos all multiples
+// of DIRECT_ALIGN; stops short only at the end of the file. Returns
+// the bytes read, or -1.
+static ssize_t pread_direct( int fd, ucharptr buf, size_t len, off_t pos )
+{
+    size_t got(0);
+    while ( got < len )
+    {
+        ssize_t n = ::pread( fd, buf + got, len - got, pos + got );
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n < 0 )
+            return -1;
+        got += n;
+        if ( n == 0 || n % DIRECT_ALIGN != 0 )
+            break;
+    }
+    return got;
+}
+
+// Write back and drop the pages of a range just written (len 0 for the
+// rest of the file), so that with direct I/O bulk writes leave the page
+// cache as they found it.
+static void drop_pages( int fd, off_t pos = 0, off_t len = 0 )
+{
+    sync_file_range( fd, pos, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER );
+    posix_fadvise( fd, pos, len, POSIX_FADV_DONTNEED );
+}
+
+// identifies a bucket file's contents to the block cache
+static std::atomic<uint64_t> next_file_id( 0 );
+
+static void add_stats( DhtBucketStats& to, const DhtBucketStats& from )
+{
+    to._scanned       += from._scanned;
+    to._bytes_read    += from._bytes_read;
+    to._bytes_written += from._bytes_written;
+    to._opens         += from._opens;
+    to._lock_waits    += from._lock_waits;
+    to._lock_wait_ns  += from._lock_wait_ns;
+}
+
+// uncontended, this costs no more than the plain lock
+void DiskHashTable::BucketMutex::lock()
+{
+    if ( try_lock() )
+        return;
+    auto t0 = std::chrono::steady_clock::now();
+    std::shared_mutex::lock();
+    _waits.fetch_add( 1, std::memory_order_relaxed );
+    _wait_ns.fetch_add( std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - t0 ).count(), std::memory_order_relaxed );
+}
+
+void DiskHashTable::BucketMutex::lock_shared()
+{
+    if ( try_lock_shared() )
+        return;
+    auto t0 = std::chrono::steady_clock::now();
+    std::shared_mutex::lock_shared();
+    _waits.fetch_add( 1, std::memory_order_relaxed );
+    _wait_ns.fetch_add( std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - t0 ).count(), std::memory_order_relaxed );
+}
 
 DiskHashTable::BucketFile::BucketFile(
+    FilePool& pool,
     std::string fspec, 
     size_t key_len, 
     size_t val_len,
-    dht_comparitor comp_func)
-: _fspec(fspec)
+    dht_comparitor comp_func,
+    const DhtOptions& opts,
+    long rec_cnt,
+    long dead_cnt)
+: _pool(&pool)
+, _cache(nullptr)
+, _aio(nullptr)
+, _keyscan(nullptr)
+, _fspec(fspec)
+, _ready(false)
 , _keylen(key_len)
 , _vallen(val_len)
 , _reclen(key_len + val_len)
+, _split_vals(opts.split_values && val_len != 0)
+, _stride(_split_vals ? key_len : key_len + val_len)
 , _reccnt(0)
 , _compfunc(comp_func)
-, _fp(nullptr)
+, _fd(-1)
+, _vfd(-1)
+, _ifd(-1)
+, _use_index(opts.use_index)
+, _idx_ready(false)
+, _idx_dirty(false)
+, _idx_cap(0)
+, _idx_cnt(0)
+, _use_mmap(opts.use_mmap)
+, _direct(opts.direct_io)
+, _dfd(-1)
+, _dvfd(-1)
+, _blocks(nullptr)
+, _file_id(next_file_id++)
+, _map(nullptr)
+, _map_len(0)
+, _bloom_fpr(opts.bloom_fpr)
+, _bloom_max_bytes(opts.bloom_max_bytes)
+, _bloom_dirty(false)
+, _bloom_negatives(0)
+, _bloom_false_pos(0)
+, _fp_bits(opts.fingerprint_bits)
+, _sorted(opts.sorted_runs)
+, _max_runs(opts.max_runs)
+, _run_cnt(0)
+, _dead_cnt(0)
+, _dead_dirty(false)
+, _compacting(false)
+, _retired(false)
+, _scanned(0)
+, _bytes_read(0)
+, _bytes_written(0)
+, _opens(0)
+, _disk_cnt(0)
+, _wbuf_bytes(( opts.sorted_runs && opts.write_buffer == 0 ) ? RUN_MEMTABLE : opts.write_buffer)
+, _wbuf_ms(opts.write_buffer_ms)
 {
-    std::lock_guard<std::mutex> lock(fopen_mtx);
-    if ( open() )
-    {
-        struct stat stat_buf;
-        if ( !stat( fspec.c_str(), &stat_buf ) )
-            _reccnt = stat_buf.st_size / _reclen;
-        close();
-    }
+    if ( _split_vals )
+        recover_vals();
+    // the counts come from the table manifest when it's current, and
+    // only a bucket with erased records has tombstones to load
+    struct stat stat_buf;
+    bool have_stat = ( rec_cnt < 0 || dead_cnt != 0 ) && !stat( fspec.c_str(), &stat_buf );
+    if ( rec_cnt >= 0 )
+        _reccnt = rec_cnt;
+    else if ( have_stat )
+        _reccnt = stat_buf.st_size / _stride;
+    _disk_cnt = _reccnt;
+    if ( have_stat && dead_cnt != 0 )
+        dead_load( stat_buf.st_ino );
 }
 
 DiskHashTable::BucketFile::~BucketFile()
 {
+    flush_nolock();
+    if ( _bloom_dirty )
+        bloom_save();
+    if ( _dead_dirty )
+        dead_save();
+    _pool->forget( *this );
     close();
+    unmap();
 }
 
 bool DiskHashTable::BucketFile::open()
 {
-    if ( _fp == nullptr )
+    if ( _fd == -1 )
     {
-        const char *mode = (std::filesystem::exists(_fspec)) ? "r+" : "w+";
-        _fp = std::fopen( _fspec.c_str(), mode );
-        if ( _fp == nullptr )
+        _fd = ::open( _fspec.c_str(), O_RDWR | O_CREAT, 0666 );
+        if ( _fd == -1 )
         {
             std::cout << "Error opening bucket file " << _fspec << ' ' << errno << " - terminating" << std::endl;
             return false;
         }
+        _opens.fetch_add( 1, std::memory_order_relaxed );
+    }
+    if ( _split_vals && _vfd == -1 )
+    {
+        std::string vspec = val_fspec();
+        _vfd = ::open( vspec.c_str(), O_RDWR | O_CREAT, 0666 );
+        if ( _vfd == -1 )
+        {
+            std::cout << "Error opening bucket values " << vspec << ' ' << errno << " - terminating" << std::endl;
+            return false;
+        }
+    }
+    // the direct descriptors only read, once the files exist
+    if ( _direct && _dfd == -1 )
+    {
+        _dfd = ::open( _fspec.c_str(), O_RDONLY | O_DIRECT );
+        if ( _dfd == -1 )
+        {
+            std::cout << "Error opening bucket file " << _fspec << " for direct I/O " << errno << " - terminating" << std::endl;
+            return false;
+        }
+    }
+    if ( _direct && _split_vals && _dvfd == -1 )
+    {
+        std::string vspec = val_fspec();
+        _dvfd = ::open( vspec.c_str(), O_RDONLY | O_DIRECT );
+        if ( _dvfd == -1 )
+        {
+            std::cout << "Error opening bucket values " << vspec << " for direct I/O " << errno << " - terminating" << std::endl;
+            return false;
+        }
+    }
+    if ( _use_index && _ifd == -1 )
+    {
+        std::string ispec = index_fspec();
+        _ifd = ::open( ispec.c_str(), O_RDWR | O_CREAT, 0666 );
+        if ( _ifd == -1 )
+        {
+            std::cout << "Error opening bucket index " << ispec << ' ' << errno << " - terminating" << std::endl;
+            return false;
+        }
     }
     return true;
 }
 
 bool DiskHashTable::BucketFile::close()
 {
-    if ( _fp != nullptr )
+    if ( _ifd != -1 )
+    {
+        if ( _idx_dirty )
+            index_write_header();
+        ::close( _ifd );
+        _ifd = -1;
+    }
+    if ( _vfd != -1 )
     {
-        std::fclose( _fp );
-        _fp = nullptr;
+        ::close( _vfd );
+        _vfd = -1;
+    }
+    for ( int *fd : { &_dfd, &_dvfd } )
+    {
+        if ( *fd != -1 )
+            ::close( *fd );
+        *fd = -1;
+    }
+    if ( _fd != -1 )
+    {
+        ::close( _fd );
+        _fd = -1;
     }
     return true;
 }
 
+// One-time setup on first use, which needs the bucket to itself and
+// so is done before an operation takes its own lock: loading the Bloom
+// filter and the index, and gathering the fingerprints or the runs.
+void DiskHashTable::BucketFile::prepare()
+{
+    if ( _ready.load( std::memory_order_acquire ) )
+        return;
+    std::unique_lock<BucketMutex> lock( _mtx );
+    if ( !_ready )
+        prepare_nolock();
+}
+
+void DiskHashTable::BucketFile::prepare_nolock()
+{
+    if ( _bloom_fpr > 0 )
+        bloom_load();
+    if ( _use_index )
+    {
+        file_guard fg(*this);
+        if ( _ifd != -1 )
+            index_load();
+    }
+    if ( _fp_bits != 0 )
+        fp_rebuild();
+    if ( _sorted )
+        run_rebuild();
+    _ready.store( true, std::memory_order_release );
+}
+
+// Found records go into the table's cache. Doing that under the bucket
+// lock keeps it ordered with updates, so a stale value can't land after
+// a newer one.
 off_t DiskHashTable::BucketFile::search(ucharptr_c key, ucharptr val)
 {
-    std::lock_guard<std::mutex> lock(_mtx);
-    return search_nolock(key, val);
+    prepare();
+    std::shared_lock<BucketMutex> lock(_mtx);
+    if ( _cache == nullptr )
+        return search_nolock(key, val);
+    // the cache wants the value even if the caller doesn't
+    thread_local std::vector<uchar> scratch;
+    if ( val == nullptr && _vallen != 0 )
+    {
+        scratch.resize( _vallen );
+        val = scratch.data();
+    }
+    off_t pos = search_nolock(key, val);
+    if ( pos != -1 )
+        _cache->put( key, val );
+    return pos;
+}
+
+// append key unless it is already there, as one step
+DhtResult DiskHashTable::BucketFile::find_or_insert(ucharptr_c key, ucharptr_c val, ucharptr existing)
+{
+    prepare();
+    std::unique_lock<BucketMutex> lock(_mtx);
+    if ( search_nolock(key, existing) != -1 )
+        return DHT_FOUND;
+    return append_nolock(key, val) ? DHT_INSERTED : DHT_ERROR;
+}
+
+DhtResult DiskHashTable::BucketFile::upsert(ucharptr_c key, ucharptr_c val)
+{
+    prepare();
+    std::unique_lock<BucketMutex> lock(_mtx);
+    file_guard fg(*this);
+    off_t pos = search_nolock(key);
+    if ( pos == -1 )
+        return append_nolock(key, val) ? DHT_INSERTED : DHT_ERROR;
+    return rewrite_nolock(pos, key, val) ? DHT_UPDATED : DHT_ERROR;
 }
 
 off_t DiskHashTable::BucketFile::search_nolock(ucharptr_c key, ucharptr val)
 {
+    uint64_t hash = key_hash( key, _keylen );
+    if ( _bloom && !_bloom->contains( hash ) )
+    {
+        _bloom_negatives.fetch_add( 1, std::memory_order_relaxed );
+        return -1;
+    }
     file_guard fg(*this);
-    int max_item_cnt = TABLE_BUFF_SIZE / _reclen;
-    BuffPtr buff = get_file_buff();
-    std::fseek(_fp, 0, SEEK_SET);
-    fpos_t pos;  // file position at start of block
-    std::fgetpos(_fp, &pos);
-    size_t rec_cnt = std::fread(buff.get(), _reclen, max_item_cnt, _fp);
-    while ( rec_cnt > 0 ) {
-        unsigned char *p = buff.get();
-        for ( int i(0); i < rec_cnt; ++i ) {
-            if ( _compfunc( p, key, _keylen ) ) {
-                if ( _vallen != 0 && val != nullptr )
-                    std::memcpy( val, p + _keylen, _vallen );
-                off_t off = pos.__pos + ( p - buff.get() );
-                return off;
+    long found = -1;
+    if ( _sorted )
+    {
+        found = run_find( key, hash, val );
+    }
+    else if ( _idx_ready )
+    {
+        found = index_find( key, hash );
+        if ( found != -1 && _vallen != 0 && val != nullptr )
+            read_val( found, val );
+    }
+    else if ( _fps )
+    {
+        found = fp_find( key, hash, val );
+    }
+    else if ( _keyscan != nullptr )
+    {
+        // memcmp keys - let the scan kernel take a block at a time
+        size_t seen(0);
+        scan_blocks_nolock( 0, [&]( ucharptr_c recs, size_t first, size_t cnt ) {
+            for ( size_t i(0); ( i += _keyscan( recs + i * _stride, cnt - i, _stride, key, _keylen ) ) < cnt; ++i )
+            {
+                if ( is_dead( first + i ) )
+                    continue;
+                if ( _split_vals && val != nullptr )
+                    read_val( first + i, val );
+                else if ( _vallen != 0 && val != nullptr )
+                    std::memcpy( val, recs + i * _reclen + _keylen, _vallen );
+                found = first + i;
+                seen += i + 1;
+                return true;
             }
-            p += _reclen;
-        }
-        std::fgetpos( _fp, &pos );
-        rec_cnt = std::fread( buff.get(), _reclen, max_item_cnt, _fp );
+            seen += cnt;
+            return false;
+        });
+        _scanned.fetch_add( seen, std::memory_order_relaxed );
     }
-    return -1;
+    else
+    {
+        size_t seen(0);
+        scan_nolock( 0, [&]( ucharptr_c p, size_t recno ) {
+            seen++;
+            if ( !_compfunc( p, key, _keylen ) || is_dead( recno ) )
+                return false;
+            if ( _split_vals && val != nullptr )
+                read_val( recno, val );
+            else if ( _vallen != 0 && val != nullptr )
+                std::memcpy( val, p + _keylen, _vallen );
+            found = recno;
+            return true;
+        });
+        _scanned.fetch_add( seen, std::memory_order_relaxed );
+    }
+    if ( found == -1 )
+    {
+        if ( _bloom )
+            _bloom_false_pos.fetch_add( 1, std::memory_order_relaxed );
+        return -1;
+    }
+    return found * _reclen;
 }
 
 
 bool DiskHashTable::BucketFile::append( ucharptr_c key, ucharptr_c val )
 {
-    std::lock_guard<std::mutex> lock( _mtx );
+    prepare();
+    std::unique_lock<BucketMutex> lock( _mtx );
     return append_nolock( key, val );
 }
 
 bool DiskHashTable::BucketFile::append_nolock( ucharptr_c key, ucharptr_c val )
 {
-    fpos_t pos;
     file_guard fg(*this);
-    std::fseek( _fp, 0, SEEK_END );
-    std::fgetpos( _fp, &pos );
-    std::fwrite( key, _keylen, 1, _fp );
-    if ( _vallen != 0 )
+    // grow the index before the new record lands so the rebuild
+    // doesn't pick it up twice
+    if ( _idx_ready && ( _idx_cnt + 1 ) * 2 > _idx_cap )
+        index_rebuild( _idx_cap * 2 );
+    if ( !write_rec( _reccnt * _reclen, key, val ) )
+        return false;
+    uint64_t hash = key_hash( key, _keylen );
+    if ( _idx_ready )
+        index_add( hash, _reccnt );
+    if ( _fps )
+        _fps->add( hash );
+    if ( _sorted )
+        _mem.emplace( hash, _reccnt - _disk_cnt );
+    _reccnt++;
+    if ( _bloom )
     {
-        if ( val != nullptr )
-            std::fwrite( val, _vallen, 1, _fp );
+        // past its design capacity the filter's false positive rate
+        // climbs quickly, so resize rather than keep adding
+        if ( _bloom->count() >= _bloom->capacity() )
+            bloom_rebuild( _bloom->capacity() * 2 );
         else
-            std::fwrite( "", 1, _vallen, _fp );
+            _bloom->add( hash );
+        _bloom_dirty = true;
     }
-    _reccnt++;
+    if ( !_pend.empty()
+      && ( _pend.size() + _vpend.size() >= _wbuf_bytes
+        || ( _wbuf_ms != 0 && std::chrono::steady_clock::now() - _pend_since >= std::chrono::milliseconds( _wbuf_ms ) ) ) )
+        flush_nolock();
     return true;
 }
 
 bool DiskHashTable::BucketFile::update(ucharptr_c key, ucharptr_c val)
 {
-    std::lock_guard<std::mutex> lock( _mtx );
+    prepare();
+    std::unique_lock<BucketMutex> lock( _mtx );
     return update_nolock( key, val );
 }
 
@@ -131,189 +505,2921 @@ bool DiskHashTable::BucketFile::update_nolock(ucharptr_c key, ucharptr_c val)
 {
     file_guard fg(*this);
     off_t pos = search_nolock( key );
-    if( pos != -1 )
+    return pos != -1 && rewrite_nolock( pos, key, val );
+}
+
+// overwrite the record for key at pos, which the caller found
+bool DiskHashTable::BucketFile::rewrite_nolock( off_t pos, ucharptr_c key, ucharptr_c val )
+{
+    if ( !write_rec( pos, key, val ) )
+        return false;
+    log_rewrite( pos / _reclen );
+    if ( _cache != nullptr )
+        _cache->refresh( key, val );
+    return true;
+}
+
+// Mark the first live copy of key erased. Only the tombstone bitmap
+// changes; it reaches disk with the next flush(), and the record's
+// space comes back when the bucket is compacted.
+bool DiskHashTable::BucketFile::erase( ucharptr_c key )
+{
+    prepare();
+    std::unique_lock<BucketMutex> lock( _mtx );
+    off_t pos = search_nolock( key );
+    if ( pos == -1 )
+        return false;
+    set_dead( pos / _reclen );
+    log_rewrite( pos / _reclen );
+    if ( _cache != nullptr )
+        _cache->erase( key );
+    return true;
+}
+
+// Copy up to max whole records, starting with record from, into dst,
+// and if dead is given, which of them are erased (left empty if none
+// are). Returns the number copied.
+size_t DiskHashTable::BucketFile::read_block( size_t from, size_t max, ucharptr dst, std::vector<bool> *dead )
+{
+    std::shared_lock<BucketMutex> lock( _mtx );
+    if ( from >= _reccnt )
+        return 0;
+    size_t cnt = std::min<size_t>( max, _reccnt - from );
+    file_guard fg(*this);
+    if ( !read_recs( from, cnt, dst ) )
+        return 0;
+    if ( dead != nullptr )
     {
-        std::fseek( _fp, pos, SEEK_SET );
-        std::fwrite( key, _keylen, 1, _fp );
-        if ( _vallen != 0 )
+        dead->clear();
+        if ( _dead_cnt != 0 )
+            for ( size_t i(0); i < cnt; ++i )
+                dead->push_back( is_dead( from + i ) );
+    }
+    return cnt;
+}
+
+// Hand fn every live record of the bucket in runs, as
+// scan_blocks_nolock; erased records split a run in two. Split values
+// are joined back up with their keys first.
+void DiskHashTable::BucketFile::scan_blocks( const BlockFunc& fn )
+{
+    std::shared_lock<BucketMutex> lock( _mtx );
+    if ( _reccnt == 0 )
+        return;
+    file_guard fg(*this);
+    std::vector<uchar> joined;
+    scan_blocks_nolock( 0, [&]( ucharptr_c keys, size_t first, size_t cnt ) {
+        ucharptr recs = keys;
+        if ( _split_vals )
         {
-            if ( val != nullptr )
-                std::fwrite( val, _vallen, 1, _fp );
-            else
-                std::fwrite( "", 1, _vallen, _fp );
+            joined.resize( cnt * _reclen );
+            if ( !join_recs( keys, first, cnt, joined.data() ) )
+                return true;
+            recs = joined.data();
         }
-        return true;
-    }
-    return false;
+        if ( _dead_cnt == 0 )
+        {
+            fn( recs, cnt );
+            return false;
+        }
+        size_t run(0);
+        for ( size_t i(0); i <= cnt; ++i )
+        {
+            if ( i < cnt && !is_dead( first + i ) )
+                continue;
+            if ( i > run )
+                fn( recs + run * _reclen, i - run );
+            run = i + 1;
+        }
+        return false;
+    });
 }
 
-// read a specific record from the file. Return true
-// if record was read, or false if EOF.
-bool DiskHashTable::BucketFile::read( size_t recno, ucharptr key, ucharptr val )
+// Find each of keys[items[j]] with a single pass over the bucket (or
+// through the index), setting recnos[j] to its record number or -1.
+void DiskHashTable::BucketFile::find_batch_nolock( const ItemList& items, ucharptr_c keys, std::vector<long>& recnos )
 {
-    std::lock_guard<std::mutex> lock( _mtx );
+    recnos.assign( items.size(), -1 );
+    std::unordered_multimap<uint64_t, size_t> want;
+    for ( size_t j(0); j < items.size(); ++j )
+    {
+        ucharptr key = keys + items[ j ] * _keylen;
+        uint64_t hash = key_hash( key, _keylen );
+        if ( _bloom && !_bloom->contains( hash ) )
+            _bloom_negatives.fetch_add( 1, std::memory_order_relaxed );
+        else
+            want.emplace( hash, j );
+    }
+    if ( want.empty() )
+        return;
+
     file_guard fg(*this);
-    BuffPtr buff = get_file_buff();
-    off_t pos = recno * _reclen;
-    std::fseek( _fp, pos, SEEK_SET );
-    if ( std::fread( buff.get(), _reclen, 1, _fp ) != EOF )
-    {
-        ucharptr p = buff.get();
-        std::memcpy( key, p, _keylen );
-        if ( _vallen != 0 )
-            std::memcpy( val, p + _keylen, _vallen );
-        return true;
+    if ( _sorted )
+    {
+        for ( auto& [hash, j] : want )
+            recnos[ j ] = run_find( keys + items[ j ] * _keylen, hash );
     }
-    return false;
+    else if ( _idx_ready )
+    {
+        for ( auto& [hash, j] : want )
+            recnos[ j ] = index_find( keys + items[ j ] * _keylen, hash );
+    }
+    else if ( _fps )
+    {
+        for ( auto& [hash, j] : want )
+            recnos[ j ] = fp_find( keys + items[ j ] * _keylen, hash );
+    }
+    else
+    {
+        size_t left = want.size();
+        size_t seen(0);
+        scan_nolock( 0, [&]( ucharptr_c p, size_t recno ) {
+            seen++;
+            auto range = want.equal_range( key_hash( p, _keylen ) );
+            for ( auto itr = range.first; itr != range.second; ++itr )
+            {
+                size_t j = itr->second;
+                if ( recnos[ j ] == -1 && _compfunc( p, keys + items[ j ] * _keylen, _keylen ) && !is_dead( recno ) )
+                {
+                    recnos[ j ] = recno;
+                    left--;
+                }
+            }
+            return left == 0;
+        });
+        _scanned.fetch_add( seen, std::memory_order_relaxed );
+    }
+    if ( _bloom )
+        for ( auto& [hash, j] : want )
+            if ( recnos[ j ] == -1 )
+                _bloom_false_pos.fetch_add( 1, std::memory_order_relaxed );
 }
 
-// maintain a map of file buffers - one for each thread
-BuffPtr DiskHashTable::BucketFile::get_file_buff()
+size_t DiskHashTable::BucketFile::search_batch( const ItemList& items, ucharptr_c keys, ucharptr vals, DhtResult *results )
 {
-    std::hash<std::thread::id> hasher;
-    size_t id_hash = hasher( std::this_thread::get_id() );
-    if ( buff_map.find( id_hash ) == buff_map.end() )
+    prepare();
+    std::shared_lock<BucketMutex> lock( _mtx );
+    std::vector<long> recnos;
+    find_batch_nolock( items, keys, recnos );
+    size_t found(0);
+    for ( size_t j(0); j < items.size(); ++j )
+    {
+        results[ items[ j ] ] = ( recnos[ j ] == -1 ) ? DHT_MISSING : DHT_FOUND;
+        if ( recnos[ j ] != -1 )
+            found++;
+    }
+    if ( found != 0 && vals != nullptr && _vallen != 0 )
     {
-        buff_map[ id_hash ] = BuffPtr(
-            new unsigned char[ TABLE_BUFF_SIZE ],
-            std::default_delete<uchar[]>()
-        );
+        file_guard fg(*this);
+        for ( size_t j(0); j < items.size(); ++j )
+            if ( recnos[ j ] != -1 )
+                read_val( recnos[ j ], vals + items[ j ] * _vallen );
     }
-    return buff_map[ id_hash ];
+    return found;
 }
 
-//////////////////////////////////////////////////////////////////////////////
-// DiskHashTable
-//
-// Default hasher
-DiskHashTable::DiskHashTable()
-{}
-
-bool DiskHashTable::open(
-    const std::string  path_name,
-    const std::string  base_name,
-    size_t             key_len,
-    size_t             val_len,
-    dht_comparitor     comp_func,
-    dht_hasher         hash_func
-) {
-    name     = base_name;
-    keylen   = key_len;
-    vallen   = val_len;
-    reclen   = key_len + val_len;
-    reccnt   = 0;
-    compfunc = comp_func;
-    hashfunc = hash_func;
-
-    std::stringstream ss;
-    ss << path_name << '/' << name << '/';
-    path = ss.str();
-    std::filesystem::create_directories( path );
-
-    // preload the bucket file table so we have record counts
-    // but only for files that exist
-    char buff[ BUCKET_ID_WIDTH + 1 ];
-    for ( int i(0); i < BUCKET_HI; ++i )
+// Hint the kernel to read what looking up keys[items[j]] will: the block
+// each run's fences point at, the records whose fingerprints match, the
+// index slots (the records they lead to aren't known yet), or else the
+// whole file. Keys the Bloom filter rules out need nothing.
+void DiskHashTable::BucketFile::prefetch( const ItemList& items, ucharptr_c keys )
+{
+    if ( _direct )
+        return;
+    prepare();
+    std::shared_lock<BucketMutex> lock( _mtx );
+    std::vector<uint64_t> hashes;
+    for ( size_t i : items )
     {
-        std::sprintf( buff, "%0*x", BUCKET_ID_WIDTH, i );
-        get_bucket( buff, true );
+        uint64_t hash = key_hash( keys + i * _keylen, _keylen );
+        if ( !_bloom || _bloom->contains( hash ) )
+            hashes.push_back( hash );
     }
+    if ( hashes.empty() || _disk_cnt == 0 )
+        return;
 
-    return true;
+    file_guard fg(*this);
+    auto will_need = []( int fd, off_t pos, off_t len ) {
+        posix_fadvise( fd, pos, len, POSIX_FADV_WILLNEED );
+    };
+    if ( _sorted )
+    {
+        size_t per = run_block();
+        for ( uint64_t hash : hashes )
+            for ( auto& run : _runs )
+            {
+                size_t b = std::lower_bound( run._fence.begin(), run._fence.end(), hash ) - run._fence.begin();
+                if ( b != 0 )
+                    b--;
+                // and the next block, which equal hashes may run on into
+                size_t first = run._start + b * per;
+                size_t cnt = std::min( 2 * per, run._start + run._cnt - first );
+                will_need( _fd, first * _reclen, cnt * _reclen );
+            }
+    }
+    else if ( _idx_ready )
+    {
+        for ( uint64_t hash : hashes )
+            will_need( _ifd, sizeof(BucketIndexHeader) + ( hash & ( _idx_cap - 1 ) ) * sizeof(BucketIndexSlot), INDEX_PROBE * sizeof(BucketIndexSlot) );
+    }
+    else if ( _fps )
+    {
+        for ( uint64_t hash : hashes )
+            for ( size_t recno = _fps->next( hash, 0 ); recno < _disk_cnt; recno = _fps->next( hash, recno + 1 ) )
+            {
+                will_need( _fd, recno * _stride, _stride );
+                if ( _split_vals )
+                    will_need( _vfd, recno * _vallen, _vallen );
+            }
+    }
+    else
+    {
+        will_need( _fd, 0, _disk_cnt * _stride );
+    }
 }
 
-DiskHashTable::~DiskHashTable()
-{}
-
-std::string DiskHashTable::calc_bucket_id( ucharptr_c key )
+size_t DiskHashTable::BucketFile::insert_batch( const ItemList& items, ucharptr_c keys, ucharptr_c vals, DhtResult *results )
 {
-    return hashfunc( key, keylen, BUCKET_ID_WIDTH );
+    prepare();
+    std::unique_lock<BucketMutex> lock( _mtx );
+    std::vector<long> recnos;
+    find_batch_nolock( items, keys, recnos );
+    // keys appended by this batch, so a repeated key is only added once
+    std::unordered_multimap<uint64_t, size_t> added;
+    size_t inserted(0);
+    for ( size_t j(0); j < items.size(); ++j )
+    {
+        size_t i = items[ j ];
+        ucharptr key = keys + i * _keylen;
+        if ( recnos[ j ] != -1 )
+        {
+            results[ i ] = DHT_FOUND;
+            continue;
+        }
+        uint64_t hash = key_hash( key, _keylen );
+        auto range = added.equal_range( hash );
+        auto itr = range.first;
+        while ( itr != range.second && !_compfunc( keys + itr->second * _keylen, key, _keylen ) )
+            ++itr;
+        if ( itr != range.second )
+        {
+            results[ i ] = DHT_FOUND;
+            continue;
+        }
+        if ( append_nolock( key, ( vals != nullptr ) ? vals + i * _vallen : nullptr ) )
+        {
+            results[ i ] = DHT_INSERTED;
+            added.emplace( hash, i );
+            inserted++;
+        }
+        else
+        {
+            results[ i ] = DHT_ERROR;
+        }
+    }
+    return inserted;
 }
 
-bool DiskHashTable::search( ucharptr_c key, ucharptr val )
+size_t DiskHashTable::BucketFile::update_batch( const ItemList& items, ucharptr_c keys, ucharptr_c vals, DhtResult *results )
 {
-    std::string bucket = calc_bucket_id( key );
-    BucketFilePtr bp = get_bucket( bucket );
-    return bp != nullptr && bp->search( key, val ) != -1;
+    prepare();
+    std::unique_lock<BucketMutex> lock( _mtx );
+    std::vector<long> recnos;
+    find_batch_nolock( items, keys, recnos );
+    size_t updated(0);
+    for ( size_t j(0); j < items.size(); ++j )
+    {
+        size_t i = items[ j ];
+        if ( recnos[ j ] == -1 )
+        {
+            results[ i ] = DHT_MISSING;
+            continue;
+        }
+        file_guard fg(*this);
+        ucharptr_c val = ( vals != nullptr ) ? vals + i * _vallen : nullptr;
+        if ( rewrite_nolock( recnos[ j ] * _reclen, keys + i * _keylen, val ) )
+        {
+            results[ i ] = DHT_UPDATED;
+            updated++;
+        }
+        else
+        {
+            results[ i ] = DHT_ERROR;
+        }
+    }
+    return updated;
 }
 
-bool DiskHashTable::insert( ucharptr_c key, ucharptr_c val )
+// copy len bytes at offset pos of the bucket file (or with vals, the
+// values file) into dst
+bool DiskHashTable::BucketFile::read_at( off_t pos, size_t len, ucharptr dst, bool vals )
 {
-    std::string bucket = calc_bucket_id( key );
-    BucketFilePtr bp = get_bucket( bucket );
-    bool ok = bp != nullptr;
-    if ( ok )
-        ok = bp->search( key, val ) == -1;
-    if ( ok )
-        ok = bp->append( key, val );
-    if ( ok )
-        reccnt++;
-    return ok;
+    off_t disk_len = _disk_cnt * ( vals ? _vallen : _stride );
+    const std::vector<uchar>& pend = vals ? _vpend : _pend;
+    if ( pos < disk_len && pos + (off_t)len > disk_len )
+    {
+        // straddles the end of the file and the write buffer
+        size_t head = disk_len - pos;
+        return read_at( pos, head, dst, vals ) && read_at( disk_len, len - head, dst + head, vals );
+    }
+    if ( pos >= disk_len )
+    {
+        // still in the write buffer
+        if ( pos - disk_len + len > pend.size() )
+            return false;
+        std::memcpy( dst, pend.data() + ( pos - disk_len ), len );
+        return true;
+    }
+    ucharptr map;
+    if ( !vals && _use_mmap && ( map = map_nolock( pos + len ) ) != nullptr )
+    {
+        std::memcpy( dst, map + pos, len );
+        return true;
+    }
+    return read_full( vals ? _vfd : _fd, dst, len, pos );
 }
 
-bool DiskHashTable::append( ucharptr_c key, ucharptr_c val )
+// the value of record recno
+bool DiskHashTable::BucketFile::read_val( size_t recno, ucharptr dst )
 {
-    std::string bucket = calc_bucket_id( key );
-    BucketFilePtr bp = get_bucket( bucket );
-    bool ok = bp != nullptr;
-    if ( ok )
-        ok = bp->append( key, val );
-    if ( ok )
-        reccnt++;
-    return ok;
+    if ( _split_vals )
+        return read_at( recno * _vallen, _vallen, dst, true );
+    return read_at( recno * _reclen + _keylen, _vallen, dst );
 }
 
-bool DiskHashTable::update( ucharptr_c key, ucharptr_c val )
+// copy cnt whole records, key then value, from record from on into dst
+bool DiskHashTable::BucketFile::read_recs( size_t from, size_t cnt, ucharptr dst )
 {
-    std::string bucket = calc_bucket_id( key );
-    BucketFilePtr bp = get_bucket( bucket );
-    return bp != nullptr && bp->update( key, val );
+    if ( !_split_vals )
+        return read_at( from * _reclen, cnt * _reclen, dst );
+    std::vector<uchar> keys( cnt * _keylen );
+    return read_at( from * _keylen, keys.size(), keys.data() ) && join_recs( keys.data(), from, cnt, dst );
 }
 
-// return the file pointer for the given bucket
-// Open the file pointer if it's not already
-DiskHashTable::BucketFilePtr DiskHashTable::get_bucket( const std::string& bucket, bool must_exist )
+// lay out the cnt keys of records from on with their values at dst
+bool DiskHashTable::BucketFile::join_recs( ucharptr_c keys, size_t from, size_t cnt, ucharptr dst )
 {
-    auto itr = fp_map.find( bucket );
-    if ( itr != fp_map.end() )
-        return itr->second;
-
-    bool exists;
-    std::string fspec = get_bucket_fspec( bucket, &exists );
-    BucketFilePtr bf = nullptr;
-    if ( exists || !must_exist )
+    std::vector<uchar> vals( cnt * _vallen );
+    if ( !read_at( from * _vallen, vals.size(), vals.data(), true ) )
+        return false;
+    for ( size_t i(0); i < cnt; ++i )
     {
-        bf = std::make_shared<BucketFile>( fspec, keylen, vallen, compfunc );
-        if ( bf != nullptr )
-            fp_map.insert( {bucket, bf} );
+        std::memcpy( dst + i * _reclen, keys + i * _keylen, _keylen );
+        std::memcpy( dst + i * _reclen + _keylen, vals.data() + i * _vallen, _vallen );
     }
-    return bf;
+    return true;
 }
 
-std::string DiskHashTable::get_bucket_fspec( const std::string& bucket, bool* exists )
+// pread_full and pwrite_full on one of the bucket's files, counted;
+// with direct I/O, reads of the bucket and values files go around the
+// page cache
+bool DiskHashTable::BucketFile::read_full( int fd, void *dst, size_t len, off_t pos )
 {
-    return DiskHashTable::get_bucket_fspec( path, name, bucket, exists );
+    if ( _direct && ( fd == _fd || fd == _vfd ) )
+        return read_direct( fd == _vfd, (ucharptr)dst, len, pos );
+    _bytes_read.fetch_add( len, std::memory_order_relaxed );
+    return pread_full( fd, dst, len, pos );
 }
 
-std::string DiskHashTable::get_bucket_fspec( const std::string path, const std::string base, const std::string bucket, bool* exists )
+bool DiskHashTable::BucketFile::write_full( int fd, const void *src, size_t len, off_t pos )
 {
-    std::stringstream ss;
-    ss << path << '/' << base << '_' << bucket;
-    if ( exists != nullptr )
-        *exists = std::filesystem::exists( ss.str() );
-    return ss.str();
-}
-
-bool DiskHashTable::default_comparitor( const void * lhs, const void * rhs, size_t keylen ) {
-    return std::memcmp(lhs, rhs, keylen) == 0;
+    if ( _blocks != nullptr && ( fd == _fd || fd == _vfd ) )
+        forget_blocks( fd == _vfd, pos, len );
+    _bytes_written.fetch_add( len, std::memory_order_relaxed );
+    return pwrite_full( fd, src, len, pos );
 }
 
-std::string DiskHashTable::default_hasher( const void * key, size_t keylen, size_t hashlen )
+// Read len bytes at pos of the bucket file (or with vals, the values
+// file) through its O_DIRECT descriptor: whole blocks into an aligned
+// staging buffer, a TABLE_BUFF_SIZE at a time. Reads of a few blocks -
+// lookups, not scans - go through the block cache, so scans can't
+// sweep it clean.
+bool DiskHashTable::BucketFile::read_direct( bool vals, ucharptr dst, size_t len, off_t pos )
 {
-    MD5 md5;
-    md5.update( key, keylen );
-    md5.finalize();
-    return md5.hexdigest().substr( 0, hashlen );
+    int      fd     = vals ? _dvfd : _dfd;
+    uint64_t key[2] = { _file_id * 2 + vals, 0 };
+    size_t   first  = pos / DIRECT_ALIGN;
+    size_t   end    = ( pos + len + DIRECT_ALIGN - 1 ) / DIRECT_ALIGN;
+    bool     cached = _blocks != nullptr && end - first <= DIRECT_CACHE_MAX;
+    ucharptr stage  = get_file_buff( 2 );
+    if ( cached )
+    {
+        size_t b = first;
+        for ( key[1] = b; b < end && _blocks->get( key, stage + ( b - first ) * DIRECT_ALIGN ); key[1] = ++b )
+            ;
+        if ( b == end )
+        {
+            std::memcpy( dst, stage + ( pos - first * DIRECT_ALIGN ), len );
+            return true;
+        }
+    }
+    while ( len != 0 )
+    {
+        off_t   from = pos / DIRECT_ALIGN * DIRECT_ALIGN;
+        size_t  skew = pos - from;
+        size_t  n    = std::min<size_t>( len, TABLE_BUFF_SIZE - DIRECT_ALIGN - skew );
+        size_t  span = ( skew + n + DIRECT_ALIGN - 1 ) / DIRECT_ALIGN * DIRECT_ALIGN;
+        ssize_t got  = pread_direct( fd, stage, span, from );
+        if ( got < (ssize_t)( skew + n ) )
+            return false;
+        _bytes_read.fetch_add( got, std::memory_order_relaxed );
+        if ( cached )
+        {
+            for ( size_t at(0); at + DIRECT_ALIGN <= (size_t)got; at += DIRECT_ALIGN )
+            {
+                key[1] = ( from + at ) / DIRECT_ALIGN;
+                _blocks->put( key, stage + at );
+            }
+        }
+        std::memcpy( dst, stage + skew, n );
+        dst += n;
+        pos += n;
+        len -= n;
+    }
+    return true;
+}
+
+// drop the cached blocks a write to the bucket (or values) file covers
+void DiskHashTable::BucketFile::forget_blocks( bool vals, off_t pos, size_t len )
+{
+    uint64_t key[2] = { _file_id * 2 + vals, 0 };
+    for ( key[1] = pos / DIRECT_ALIGN; key[1] < ( pos + len + DIRECT_ALIGN - 1 ) / DIRECT_ALIGN; ++key[1] )
+        _blocks->erase( key );
+}
+
+DhtBucketStats DiskHashTable::BucketFile::stats()
+{
+    return DhtBucketStats{ _scanned, _bytes_read, _bytes_written, _opens, _mtx._waits, _mtx._wait_ns };
+}
+
+// lay out a record at dst, zero-filling the value if none is given
+void DiskHashTable::BucketFile::fill_rec( ucharptr dst, ucharptr_c key, ucharptr_c val )
+{
+    std::memcpy( dst, key, _keylen );
+    if ( _vallen != 0 )
+        fill_val( dst + _keylen, val );
+}
+
+void DiskHashTable::BucketFile::fill_val( ucharptr dst, ucharptr_c val )
+{
+    if ( val != nullptr )
+        std::memcpy( dst, val, _vallen );
+    else
+        std::memset( dst, 0, _vallen );
+}
+
+// Write a whole record at offset pos (record number times _reclen).
+// Writing at the end of the bucket appends; with a write buffer the
+// record is held in memory until the next flush.
+bool DiskHashTable::BucketFile::write_rec( off_t pos, ucharptr_c key, ucharptr_c val )
+{
+    size_t recno = pos / _reclen;
+    bool ok;
+    if ( _split_vals )
+        ok = write_at( recno * _keylen, _keylen, [&]( ucharptr dst ) { std::memcpy( dst, key, _keylen ); }, false )
+          && write_at( recno * _vallen, _vallen, [&]( ucharptr dst ) { fill_val( dst, val ); }, true );
+    else
+        ok = write_at( pos, _reclen, [&]( ucharptr dst ) { fill_rec( dst, key, val ); }, false );
+    // unbuffered appends go straight to the end of the file
+    if ( ok && recno >= _disk_cnt && _wbuf_bytes == 0 )
+        _disk_cnt = recno + 1;
+    return ok;
+}
+
+// write the len bytes fill( dst ) lays out at offset pos of the bucket
+// file or, with vals, the values file - or its write buffer
+template <class F>
+bool DiskHashTable::BucketFile::write_at( off_t pos, size_t len, F fill, bool vals )
+{
+    off_t disk_len = _disk_cnt * ( vals ? _vallen : _stride );
+    std::vector<uchar>& pend = vals ? _vpend : _pend;
+    ucharptr map;
+    if ( pos >= disk_len )
+    {
+        size_t at = pos - disk_len;
+        if ( at < pend.size() )
+        {
+            fill( pend.data() + at );
+            return true;
+        }
+        if ( _wbuf_bytes != 0 )
+        {
+            if ( _pend.empty() )
+                _pend_since = std::chrono::steady_clock::now();
+            pend.resize( at + len );
+            fill( pend.data() + at );
+            return true;
+        }
+    }
+    else if ( !vals && _use_mmap && ( map = map_nolock( pos + len ) ) != nullptr )
+    {
+        // in place - the file already covers this record
+        fill( map + pos );
+        return true;
+    }
+    ucharptr buff = get_file_buff();
+    fill( buff );
+    return write_full( vals ? _vfd : _fd, buff, len, pos );
+}
+
+// write out any buffered appends in one go; with sorted runs, in key
+// hash order as a new run
+bool DiskHashTable::BucketFile::flush_nolock()
+{
+    if ( _pend.empty() )
+        return true;
+    file_guard fg(*this);
+    const uchar *data = _pend.data();
+    std::vector<uchar>    sorted;
+    std::vector<size_t>   order;    // sorted record i is order[ i ] of _pend
+    std::vector<uint64_t> fence;
+    if ( _sorted )
+    {
+        size_t per = run_block();
+        sorted.resize( _pend.size() );
+        order.reserve( _mem.size() );
+        for ( auto& [hash, i] : _mem )
+        {
+            if ( order.size() % per == 0 )
+                fence.push_back( hash );
+            std::memcpy( sorted.data() + order.size() * _reclen, _pend.data() + i * _reclen, _reclen );
+            order.push_back( i );
+        }
+        data = sorted.data();
+    }
+    bool ok = false;
+    if ( _aio != nullptr )
+    {
+        AioBatch batch;
+        batch.write( *_aio, _fd, data, _pend.size(), _disk_cnt * _stride );
+        if ( _split_vals )
+            batch.write( *_aio, _vfd, _vpend.data(), _vpend.size(), _disk_cnt * _vallen );
+        ok = batch.wait();
+        if ( ok )
+            _bytes_written.fetch_add( _pend.size() + _vpend.size(), std::memory_order_relaxed );
+    }
+    if ( !ok && ( !write_full( _fd, data, _pend.size(), _disk_cnt * _stride )
+               || ( _split_vals && !write_full( _vfd, _vpend.data(), _vpend.size(), _disk_cnt * _vallen ) ) ) )
+    {
+        std::cout << "Error flushing bucket file " << _fspec << ' ' << errno << std::endl;
+        return false;
+    }
+    if ( _direct )
+    {
+        // from the page the flush started in to the end; a range ending
+        // mid-page can leave the pages before it cached
+        drop_pages( _fd, _disk_cnt * _stride / DIRECT_ALIGN * DIRECT_ALIGN );
+        if ( _split_vals )
+            drop_pages( _vfd, _disk_cnt * _vallen / DIRECT_ALIGN * DIRECT_ALIGN );
+    }
+    if ( _sorted )
+        run_flushed( order, std::move( fence ) );
+    _disk_cnt = _reccnt;
+    _pend.clear();
+    _vpend.clear();
+    return true;
+}
+
+// write out buffered appends and the tombstone bitmap
+bool DiskHashTable::BucketFile::flush()
+{
+    std::unique_lock<BucketMutex> lock( _mtx );
+    bool ok = flush_nolock();
+    return ( !_dead_dirty || dead_save() ) && ok;
+}
+
+// call fn( rec, recno ) for each record from recno on, until
+// it returns true. Returns true if fn stopped the scan.
+template <class F>
+bool DiskHashTable::BucketFile::scan_nolock( size_t from, F fn )
+{
+    return scan_blocks_nolock( from, [&]( ucharptr_c recs, size_t first, size_t cnt ) {
+        ucharptr p = recs;
+        for ( size_t i(0); i < cnt; ++i, p += _stride )
+            if ( fn( p, first + i ) )
+                return true;
+        return false;
+    });
+}
+
+// As scan_nolock, but fn( recs, first, cnt ) gets runs of cnt records
+// starting with record number first: straight from the mapping, a
+// TABLE_BUFF_SIZE read at a time, then from the write buffer. With
+// async I/O the read of the next chunk is in flight while fn looks at
+// the current one; with direct I/O each read covers whole blocks, and
+// the records start part way into the buffer.
+template <class F>
+bool DiskHashTable::BucketFile::scan_blocks_nolock( size_t from, F fn )
+{
+    size_t recno = from;
+    ucharptr map;
+    if ( _use_mmap && recno < _disk_cnt && ( map = map_nolock( _disk_cnt * _stride ) ) != nullptr )
+    {
+        if ( fn( map + recno * _stride, recno, _disk_cnt - recno ) )
+            return true;
+        recno = _disk_cnt;
+    }
+    else if ( recno < _disk_cnt && _aio != nullptr && !_direct )
+    {
+        size_t   max_item_cnt = TABLE_BUFF_SIZE / _stride;
+        ucharptr buff[2] = { get_file_buff( 0 ), get_file_buff( 1 ) };
+        size_t   cnt[2];
+        AioBatch batch[2];      // wait for stray reads on the way out
+        auto start = [&]( int b, size_t at ) {
+            cnt[ b ] = std::min( max_item_cnt, _disk_cnt - at );
+            batch[ b ].read( *_aio, _fd, buff[ b ], cnt[ b ] * _stride, at * _stride );
+            _bytes_read.fetch_add( cnt[ b ] * _stride, std::memory_order_relaxed );
+        };
+        int cur = 0;
+        start( cur, recno );
+        while ( recno < _disk_cnt )
+        {
+            size_t next = recno + cnt[ cur ];
+            if ( next < _disk_cnt )
+                start( cur ^ 1, next );
+            if ( !batch[ cur ].wait() && !read_full( _fd, buff[ cur ], cnt[ cur ] * _stride, recno * _stride ) )
+                break;
+            if ( fn( buff[ cur ], recno, cnt[ cur ] ) )
+                return true;
+            recno = next;
+            cur ^= 1;
+        }
+    }
+    else if ( recno < _disk_cnt )
+    {
+        size_t align = _direct ? DIRECT_ALIGN : 1;
+        size_t max_item_cnt = ( TABLE_BUFF_SIZE - 2 * ( align - 1 ) ) / _stride;
+        ucharptr buff = get_file_buff();
+        while ( recno < _disk_cnt )
+        {
+            off_t   pos  = recno * _stride;
+            off_t   from = pos / align * align;
+            size_t  skew = pos - from;
+            size_t  want = std::min( max_item_cnt, _disk_cnt - recno ) * _stride;
+            size_t  span = ( skew + want + align - 1 ) / align * align;
+            ssize_t len  = _direct ? pread_direct( _dfd, buff, span, from ) : ::pread( _fd, buff, want, pos );
+            size_t rec_cnt = ( len > (ssize_t)skew ) ? std::min( want, len - skew ) / _stride : 0;
+            if ( rec_cnt == 0 )
+                break;
+            _bytes_read.fetch_add( len, std::memory_order_relaxed );
+            if ( fn( buff + skew, recno, rec_cnt ) )
+                return true;
+            recno += rec_cnt;
+        }
+    }
+    // then anything still in the write buffer
+    recno = std::max( recno, _disk_cnt );
+    if ( recno < _reccnt )
+        return fn( _pend.data() + ( recno - _disk_cnt ) * _stride, recno, _reccnt - recno );
+    return false;
+}
+
+// Map at least the first len bytes of the file and return the mapping,
+// or null if it can't be mapped. The mapping is reserved in large
+// steps past the end of the file so appends rarely have to remap.
+// Safe to call under the shared lock: growth is serialized here and
+// earlier mappings are left in place for readers still using them.
+ucharptr DiskHashTable::BucketFile::map_nolock( size_t len )
+{
+    if ( len <= _map_len.load( std::memory_order_acquire ) )
+        return _map.load( std::memory_order_relaxed );
+    std::lock_guard<std::mutex> lock( _map_mtx );
+    size_t cur = _map_len.load( std::memory_order_relaxed );
+    if ( len <= cur )
+        return _map.load( std::memory_order_relaxed );
+    if ( _fd == -1 || !_use_mmap )
+        return nullptr;
+    size_t map_len = ( cur == 0 ) ? MMAP_STEP : cur;
+    while ( map_len < len )
+        map_len *= 2;
+    void *map = mmap( nullptr, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0 );
+    if ( map == MAP_FAILED )
+    {
+        std::cout << "Error mapping bucket file " << _fspec << ' ' << errno << std::endl;
+        _use_mmap = false;
+        return nullptr;
+    }
+    if ( cur != 0 )
+        _old_maps.emplace_back( _map.load( std::memory_order_relaxed ), cur );
+    _map.store( (ucharptr)map, std::memory_order_relaxed );
+    _map_len.store( map_len, std::memory_order_release );
+    return (ucharptr)map;
+}
+
+void DiskHashTable::BucketFile::unmap()
+{
+    for ( auto& [map, len] : _old_maps )
+        munmap( map, len );
+    _old_maps.clear();
+    if ( _map != nullptr )
+    {
+        munmap( _map, _map_len );
+        _map     = nullptr;
+        _map_len = 0;
+    }
+}
+
+// one scan buffer per thread, shared by every bucket, a second for
+// async scans to read ahead into and a third to stage direct reads in;
+// aligned for direct I/O
+ucharptr DiskHashTable::BucketFile::get_file_buff( unsigned which )
+{
+    struct aligned_free { void operator()( uchar *p ) { std::free( p ); } };
+    thread_local std::unique_ptr<uchar[], aligned_free> buff[3];
+    if ( !buff[ which ] )
+        buff[ which ].reset( (uchar*)std::aligned_alloc( DIRECT_ALIGN, TABLE_BUFF_SIZE ) );
+    return buff[ which ].get();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Bucket index
+//
+// An open-addressed (linear probing) table of {hash, recno+1} slots kept
+// in a sidecar next to the bucket file. The bucket file itself is left
+// untouched, so a table written without an index is still readable, and
+// an index that lags behind its bucket (e.g. records appended by a
+// process that wasn't maintaining it) is caught up when loaded.
+//
+uint64_t DiskHashTable::BucketFile::key_hash( ucharptr_c key, size_t keylen )
+{
+    return hash64( key, keylen, INDEX_SEED );
+}
+
+bool DiskHashTable::BucketFile::index_load()
+{
+    BucketIndexHeader hdr;
+    bool ok = read_full( _ifd, &hdr, sizeof(hdr), 0 )
+           && hdr._magic    == INDEX_MAGIC
+           && hdr._version  == INDEX_VERSION
+           && hdr._capacity >= INDEX_MIN_SLOTS
+           && ( hdr._capacity & ( hdr._capacity - 1 ) ) == 0
+           && hdr._count    <= _reccnt;
+    if ( ok )
+    {
+        _idx_cap = hdr._capacity;
+        _idx_cnt = hdr._count;
+    }
+    size_t want = INDEX_MIN_SLOTS;
+    while ( want < _reccnt * 2 )
+        want <<= 1;
+    if ( !ok || want > _idx_cap )
+        return index_rebuild( want );
+
+    // catch up on records appended since the index was last written
+    scan_nolock( _idx_cnt, [&]( ucharptr_c p, size_t recno ) {
+        index_add( key_hash( p, _keylen ), recno );
+        return false;
+    });
+    _idx_ready = true;
+    return true;
+}
+
+// build an index of the given capacity from the whole bucket file
+bool DiskHashTable::BucketFile::index_rebuild( size_t capacity )
+{
+    std::vector<BucketIndexSlot> slots( capacity, BucketIndexSlot{0, 0} );
+    size_t mask = capacity - 1;
+    scan_nolock( 0, [&]( ucharptr_c p, size_t recno ) {
+        uint64_t hash = key_hash( p, _keylen );
+        size_t slot = hash & mask;
+        while ( slots[ slot ]._recno != 0 )
+            slot = ( slot + 1 ) & mask;
+        slots[ slot ] = { hash, recno + 1 };
+        return false;
+    });
+
+    _idx_cap = capacity;
+    _idx_cnt = _reccnt;
+    size_t len = capacity * sizeof(BucketIndexSlot);
+    if ( !index_write_header()
+      || !write_full( _ifd, slots.data(), len, sizeof(BucketIndexHeader) )
+      || ftruncate( _ifd, sizeof(BucketIndexHeader) + len ) != 0 )
+    {
+        std::cout << "Error creating bucket index " << index_fspec() << ' ' << errno << std::endl;
+        _idx_ready = false;
+        return false;
+    }
+    _idx_ready = true;
+    return true;
+}
+
+bool DiskHashTable::BucketFile::index_add( uint64_t hash, size_t recno )
+{
+    BucketIndexSlot probe[ INDEX_PROBE ];
+    size_t mask = _idx_cap - 1;
+    size_t slot = hash & mask;
+    for ( size_t seen(0); seen < _idx_cap; )
+    {
+        size_t n = std::min<size_t>( INDEX_PROBE, _idx_cap - slot );
+        if ( !read_full( _ifd, probe, n * sizeof(BucketIndexSlot), sizeof(BucketIndexHeader) + slot * sizeof(BucketIndexSlot) ) )
+            break;
+        for ( size_t i(0); i < n; ++i )
+        {
+            if ( probe[ i ]._recno == 0 )
+            {
+                BucketIndexSlot s{ hash, recno + 1 };
+                write_full( _ifd, &s, sizeof(s), sizeof(BucketIndexHeader) + ( slot + i ) * sizeof(BucketIndexSlot) );
+                _idx_cnt = recno + 1;
+                _idx_dirty = true;
+                return true;
+            }
+        }
+        seen += n;
+        slot = ( slot + n ) & mask;
+    }
+    return false;
+}
+
+// return the record number of key, or -1 if it isn't in the bucket
+long DiskHashTable::BucketFile::index_find( ucharptr_c key, uint64_t hash )
+{
+    BucketIndexSlot probe[ INDEX_PROBE ];
+    ucharptr rec_key = get_file_buff();
+    size_t mask = _idx_cap - 1;
+    size_t slot = hash & mask;
+    for ( size_t seen(0); seen < _idx_cap; )
+    {
+        size_t n = std::min<size_t>( INDEX_PROBE, _idx_cap - slot );
+        if ( !read_full( _ifd, probe, n * sizeof(BucketIndexSlot), sizeof(BucketIndexHeader) + slot * sizeof(BucketIndexSlot) ) )
+            break;
+        for ( size_t i(0); i < n; ++i )
+        {
+            if ( probe[ i ]._recno == 0 )
+                return -1;
+            if ( probe[ i ]._hash != hash )
+                continue;
+            size_t recno = probe[ i ]._recno - 1;
+            if ( !is_dead( recno ) && read_at( recno * _stride, _keylen, rec_key ) && _compfunc( rec_key, key, _keylen ) )
+                return recno;
+        }
+        seen += n;
+        slot = ( slot + n ) & mask;
+    }
+    return -1;
+}
+
+bool DiskHashTable::BucketFile::index_write_header()
+{
+    BucketIndexHeader hdr{ INDEX_MAGIC, INDEX_VERSION, _idx_cap, _idx_cnt };
+    _idx_dirty = false;
+    return write_full( _ifd, &hdr, sizeof(hdr), 0 );
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Bucket Bloom filter
+//
+// Loaded from the bucket's .blm sidecar when there is one, caught up on
+// any records appended since it was saved, and rebuilt from the bucket
+// when it is missing, unreadable or has outgrown its sizing.
+//
+bool DiskHashTable::BucketFile::bloom_load()
+{
+    std::FILE *fp = std::fopen( bloom_fspec().c_str(), "r" );
+    if ( fp != nullptr )
+    {
+        auto bloom = std::make_unique<BloomFilter>();
+        if ( bloom->load( fp ) && bloom->count() <= _reccnt && _reccnt <= bloom->capacity() )
+            _bloom = std::move( bloom );
+        std::fclose( fp );
+    }
+    if ( !_bloom )
+    {
+        size_t capacity = BLOOM_MIN_KEYS;
+        while ( capacity < _reccnt * 2 )
+            capacity *= 2;
+        return bloom_rebuild( capacity );
+    }
+    if ( _bloom->count() < _reccnt )
+    {
+        file_guard fg(*this);
+        scan_nolock( _bloom->count(), [&]( ucharptr_c p, size_t recno ) {
+            _bloom->add( key_hash( p, _keylen ) );
+            return false;
+        });
+        _bloom_dirty = true;
+    }
+    return true;
+}
+
+bool DiskHashTable::BucketFile::bloom_rebuild( size_t capacity )
+{
+    _bloom = std::make_unique<BloomFilter>( capacity, _bloom_fpr, _bloom_max_bytes );
+    _bloom_dirty = true;
+    if ( _reccnt == 0 )
+        return true;
+    file_guard fg(*this);
+    scan_nolock( 0, [&]( ucharptr_c p, size_t recno ) {
+        _bloom->add( key_hash( p, _keylen ) );
+        return false;
+    });
+    return true;
+}
+
+bool DiskHashTable::BucketFile::bloom_save()
+{
+    std::FILE *fp = std::fopen( bloom_fspec().c_str(), "w" );
+    if ( fp == nullptr )
+    {
+        std::cout << "Error saving bucket filter " << bloom_fspec() << ' ' << errno << std::endl;
+        return false;
+    }
+    bool ok = _bloom->save( fp );
+    std::fclose( fp );
+    _bloom_dirty = !ok;
+    return ok;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Bucket fingerprints
+//
+// Held only in memory, so gathered with one pass over the bucket's keys
+// when it is first used, and kept in step by appends from then on.
+//
+void DiskHashTable::BucketFile::fp_rebuild()
+{
+    _fps = std::make_unique<Fingerprints>( _fp_bits );
+    _fps->reserve( _reccnt );
+    if ( _reccnt == 0 )
+        return;
+    file_guard fg(*this);
+    scan_nolock( 0, [&]( ucharptr_c p, size_t recno ) {
+        _fps->add( key_hash( p, _keylen ) );
+        return false;
+    });
+}
+
+// Return the record number of key, or -1 if it isn't in the bucket,
+// reading only records whose fingerprint matches; val, if given, gets
+// the value.
+long DiskHashTable::BucketFile::fp_find( ucharptr_c key, uint64_t hash, ucharptr val )
+{
+    ucharptr rec = get_file_buff();
+    size_t seen(0);
+    long found = -1;
+    for ( size_t recno = _fps->next( hash, 0 ); recno < _reccnt; recno = _fps->next( hash, recno + 1 ) )
+    {
+        if ( is_dead( recno ) )
+            continue;
+        seen++;
+        // the value comes along with the key unless it's split off
+        if ( !read_at( recno * _stride, _stride, rec ) || !_compfunc( rec, key, _keylen ) )
+            continue;
+        if ( val != nullptr && _vallen != 0 )
+        {
+            if ( _split_vals )
+                read_val( recno, val );
+            else
+                std::memcpy( val, rec + _keylen, _vallen );
+        }
+        found = recno;
+        break;
+    }
+    _scanned.fetch_add( seen, std::memory_order_relaxed );
+    return found;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Bucket sorted runs
+//
+// With sorted_runs the bucket file is a sequence of runs, each sorted by
+// key hash: every flush of the memtable appends one, and merging folds
+// them back into one. Where one run ends is where the hashes drop, so
+// the runs are found again with one pass over the file when the bucket
+// is first used, and nothing else need be stored. Each run keeps the
+// first hash of every RUN_BLOCK bytes of it in memory, so a lookup reads
+// about one block per run.
+//
+size_t DiskHashTable::BucketFile::run_block() const
+{
+    return std::max<size_t>( 1, RUN_BLOCK / _reclen );
+}
+
+void DiskHashTable::BucketFile::run_rebuild()
+{
+    _runs.clear();
+    _run_cnt = 0;
+    if ( _disk_cnt == 0 )
+        return;
+    file_guard fg(*this);
+    size_t per = run_block();
+    uint64_t last(0);
+    scan_nolock( 0, [&]( ucharptr_c p, size_t recno ) {
+        if ( recno >= _disk_cnt )
+            return true;
+        uint64_t hash = key_hash( p, _keylen );
+        if ( _runs.empty() || hash < last )
+            _runs.push_back( Run{ recno, 0, {} } );
+        Run& run = _runs.back();
+        if ( run._cnt % per == 0 )
+            run._fence.push_back( hash );
+        run._cnt++;
+        last = hash;
+        return false;
+    });
+    _run_cnt = _runs.size();
+}
+
+// The memtable has gone out as a new run, record order[ i ] of the
+// write buffer landing at i; tombstones follow their records.
+void DiskHashTable::BucketFile::run_flushed( const std::vector<size_t>& order, std::vector<uint64_t>&& fence )
+{
+    if ( _dead_cnt != 0 )
+    {
+        std::vector<size_t> dead;
+        for ( size_t i(0); i < order.size(); ++i )
+            if ( is_dead( _disk_cnt + order[ i ] ) )
+                dead.push_back( i );
+        _dead.resize( std::max( _dead.size(), ( _reccnt + 63 ) / 64 ), 0 );
+        for ( size_t r = _disk_cnt; r < _reccnt; ++r )
+            _dead[ r >> 6 ] &= ~( 1ull << ( r & 63 ) );
+        for ( size_t i : dead )
+        {
+            size_t r = _disk_cnt + i;
+            _dead[ r >> 6 ] |= 1ull << ( r & 63 );
+        }
+    }
+    _runs.push_back( Run{ _disk_cnt, order.size(), std::move( fence ) } );
+    _run_cnt = _runs.size();
+    _mem.clear();
+}
+
+// Return the record number of key, or -1 if it isn't in the bucket:
+// the memtable first, then each run from the newest, reading the block
+// its fences say the hash would be in. val, if given, gets the value.
+long DiskHashTable::BucketFile::run_find( ucharptr_c key, uint64_t hash, ucharptr val )
+{
+    auto range = _mem.equal_range( hash );
+    for ( auto itr = range.first; itr != range.second; ++itr )
+    {
+        ucharptr p = _pend.data() + itr->second * _reclen;
+        if ( is_dead( _disk_cnt + itr->second ) || !_compfunc( p, key, _keylen ) )
+            continue;
+        if ( val != nullptr && _vallen != 0 )
+            std::memcpy( val, p + _keylen, _vallen );
+        return _disk_cnt + itr->second;
+    }
+
+    ucharptr buff = get_file_buff();
+    size_t per = run_block();
+    size_t seen(0);
+    long found = -1;
+    for ( auto run = _runs.rbegin(); run != _runs.rend() && found == -1; ++run )
+    {
+        // the block before the first fence at or past hash may end with it
+        size_t b = std::lower_bound( run->_fence.begin(), run->_fence.end(), hash ) - run->_fence.begin();
+        if ( b != 0 )
+            b--;
+        for ( bool more = true; more && found == -1 && b < run->_fence.size(); ++b )
+        {
+            size_t first = run->_start + b * per;
+            size_t cnt = std::min( per, run->_start + run->_cnt - first );
+            if ( !read_at( first * _reclen, cnt * _reclen, buff ) )
+                break;
+            size_t lo(0), hi( cnt );
+            while ( lo < hi )
+            {
+                size_t mid = ( lo + hi ) / 2;
+                if ( key_hash( buff + mid * _reclen, _keylen ) < hash )
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            // equal hashes may carry on into the next block
+            if ( lo == cnt && b + 1 < run->_fence.size() && run->_fence[ b + 1 ] > hash )
+                more = false;
+            for ( size_t i = lo; i < cnt; ++i )
+            {
+                ucharptr p = buff + i * _reclen;
+                seen++;
+                if ( key_hash( p, _keylen ) != hash )
+                {
+                    more = false;
+                    break;
+                }
+                if ( is_dead( first + i ) || !_compfunc( p, key, _keylen ) )
+                    continue;
+                if ( val != nullptr && _vallen != 0 )
+                    std::memcpy( val, p + _keylen, _vallen );
+                found = first + i;
+                break;
+            }
+        }
+    }
+    _scanned.fetch_add( seen, std::memory_order_relaxed );
+    return found;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Bucket tombstones and compaction
+//
+// Erased records are marked in a bitmap, saved to the bucket's .del
+// sidecar with the inode of the bucket file it describes. Compacting
+// (or splitting) a bucket writes a new file and renames it into place,
+// so a bitmap left over from the old file is recognised and dropped.
+//
+void DiskHashTable::BucketFile::set_dead( size_t recno )
+{
+    if ( ( recno >> 6 ) >= _dead.size() )
+        _dead.resize( ( recno >> 6 ) + 1, 0 );
+    _dead[ recno >> 6 ] |= 1ull << ( recno & 63 );
+    _dead_cnt++;
+    _dead_dirty = true;
+}
+
+bool DiskHashTable::BucketFile::dead_load( uint64_t ino )
+{
+    std::FILE *fp = std::fopen( dead_fspec().c_str(), "r" );
+    if ( fp == nullptr )
+        return false;
+    BucketDeadHeader hdr;
+    std::vector<uint64_t> words;
+    bool ok = std::fread( &hdr, sizeof(hdr), 1, fp ) == 1
+           && hdr._magic   == DEAD_MAGIC
+           && hdr._version == DEAD_VERSION
+           && hdr._ino     == ino
+           && hdr._words   <= ( _reccnt + 63 ) / 64;
+    if ( ok )
+    {
+        words.resize( hdr._words );
+        ok = std::fread( words.data(), sizeof(uint64_t), words.size(), fp ) == words.size();
+    }
+    std::fclose( fp );
+    size_t cnt(0);
+    for ( uint64_t w : words )
+        cnt += std::popcount( w );
+    if ( !ok || cnt != hdr._count )
+    {
+        std::remove( dead_fspec().c_str() );
+        return false;
+    }
+    _dead.swap( words );
+    _dead_cnt = cnt;
+    return true;
+}
+
+// write-and-rename, as the table header
+bool DiskHashTable::BucketFile::dead_save()
+{
+    std::string fspec = dead_fspec();
+    struct stat stat_buf;
+    std::FILE *fp = nullptr;
+    if ( stat( _fspec.c_str(), &stat_buf ) == 0 )
+        fp = std::fopen( ( fspec + ".tmp" ).c_str(), "w" );
+    if ( fp == nullptr )
+    {
+        std::cout << "Error saving bucket tombstones " << fspec << ' ' << errno << std::endl;
+        return false;
+    }
+    BucketDeadHeader hdr{ DEAD_MAGIC, DEAD_VERSION, (uint64_t)stat_buf.st_ino, _dead_cnt, _dead.size() };
+    bool ok = std::fwrite( &hdr, sizeof(hdr), 1, fp ) == 1
+           && std::fwrite( _dead.data(), sizeof(uint64_t), _dead.size(), fp ) == _dead.size();
+    ok = std::fclose( fp ) == 0 && ok;
+    ok = ok && std::rename( ( fspec + ".tmp" ).c_str(), fspec.c_str() ) == 0;
+    _dead_dirty = !ok;
+    return ok;
+}
+
+// Rewrite the bucket without its erased records. The live records are
+// copied to <bucket>.compact (and their values, if split, to
+// <bucket>.compact.val) a chunk at a time under the shared lock,
+// so lookups carry on throughout and writers wait for one chunk at
+// most. pace( bytes ) hears of each chunk's I/O, and may sleep to keep
+// to a budget or return false to give up. Only the last step takes the
+// bucket to itself: it copies whatever was appended meanwhile, carries
+// over updates and erasures of records already copied, and renames the
+// new file over the old.
+bool DiskHashTable::BucketFile::compact( const PaceFunc& pace )
+{
+    if ( _sorted )
+        return merge( pace );
+    prepare();
+    // the bucket file, then the values file with split values
+    size_t      cols = _split_vals ? 2 : 1;
+    size_t      len[2] = { _stride, _vallen };
+    std::string tmp_fspec[2] = { _fspec + ".compact", _fspec + ".compact.val" };
+    int         fd[2] = { -1, -1 };
+    for ( size_t c(0); c < cols; ++c )
+    {
+        fd[ c ] = ::open( tmp_fspec[ c ].c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666 );
+        if ( fd[ c ] == -1 )
+        {
+            std::cout << "Error creating " << tmp_fspec[ c ] << ' ' << errno << std::endl;
+            if ( c != 0 )
+                ::close( fd[ 0 ] );
+            return false;
+        }
+    }
+    size_t chunk = TABLE_BUFF_SIZE / _reclen;
+    size_t recno(0);                // records before this are copied or dropped
+    size_t kept(0);                 // records in the new file
+    std::vector<uint64_t> moved;    // bit n set if old record n was copied
+
+    // copy the live records among recno..upto-1 to the new file
+    auto copy = [&]( size_t upto, size_t& bytes ) {
+        file_guard fg(*this);
+        ucharptr buff[2] = { get_file_buff( 0 ), get_file_buff( 1 ) };
+        moved.resize( ( upto + 63 ) / 64, 0 );
+        while ( recno < upto )
+        {
+            size_t n = std::min( chunk, upto - recno );
+            for ( size_t c(0); c < cols; ++c )
+                if ( !read_at( recno * len[ c ], n * len[ c ], buff[ c ], c == 1 ) )
+                    return false;
+            size_t out(0);
+            for ( size_t i(0); i < n; ++i )
+            {
+                if ( is_dead( recno + i ) )
+                    continue;
+                if ( out != i )
+                    for ( size_t c(0); c < cols; ++c )
+                        std::memmove( buff[ c ] + out * len[ c ], buff[ c ] + i * len[ c ], len[ c ] );
+                out++;
+                moved[ ( recno + i ) >> 6 ] |= 1ull << ( ( recno + i ) & 63 );
+            }
+            for ( size_t c(0); c < cols; ++c )
+                if ( !write_full( fd[ c ], buff[ c ], out * len[ c ], kept * len[ c ] ) )
+                    return false;
+            kept  += out;
+            bytes += ( n + out ) * _reclen;
+            recno += n;
+        }
+        return true;
+    };
+
+    {
+        std::unique_lock<BucketMutex> lock( _mtx );
+        _compacting = true;
+        _compact_log.clear();
+    }
+    bool ok = true;
+    while ( ok )
+    {
+        size_t bytes(0);
+        {
+            std::shared_lock<BucketMutex> lock( _mtx );
+            if ( _retired || _reccnt - recno <= chunk )
+                break;
+            ok = copy( recno + chunk, bytes );
+        }
+        ok = ok && pace( bytes );
+    }
+
+    std::unique_lock<BucketMutex> lock( _mtx );
+    _compacting = false;
+    size_t bytes(0);
+    ok = ok && !_retired && copy( _reccnt, bytes );
+    std::vector<uint64_t> dead;
+    size_t dead_cnt(0);
+    if ( ok && !_compact_log.empty() )
+    {
+        // rank[ w ] is the number of records copied from before word w
+        std::vector<size_t> rank( moved.size() + 1, 0 );
+        for ( size_t w(0); w < moved.size(); ++w )
+            rank[ w + 1 ] = rank[ w ] + std::popcount( moved[ w ] );
+        file_guard fg(*this);
+        ucharptr rec = get_file_buff();
+        for ( size_t r : _compact_log )
+        {
+            uint64_t bit = 1ull << ( r & 63 );
+            if ( ( moved[ r >> 6 ] & bit ) == 0 )
+                continue;
+            size_t at = rank[ r >> 6 ] + std::popcount( moved[ r >> 6 ] & ( bit - 1 ) );
+            if ( !is_dead( r ) )
+            {
+                for ( size_t c(0); c < cols; ++c )
+                    ok = ok && read_at( r * len[ c ], len[ c ], rec, c == 1 ) && write_full( fd[ c ], rec, len[ c ], at * len[ c ] );
+            }
+            else if ( ( at >> 6 ) >= dead.size() || ( dead[ at >> 6 ] >> ( at & 63 ) & 1 ) == 0 )
+            {
+                dead.resize( std::max( dead.size(), ( at >> 6 ) + 1 ), 0 );
+                dead[ at >> 6 ] |= 1ull << ( at & 63 );
+                dead_cnt++;
+            }
+        }
+    }
+    _compact_log.clear();
+    for ( size_t c(0); c < cols; ++c )
+    {
+        if ( _direct )
+            drop_pages( fd[ c ] );
+        ok = ::close( fd[ c ] ) == 0 && ok;
+    }
+    if ( !ok )
+    {
+        for ( size_t c(0); c < cols; ++c )
+            std::remove( tmp_fspec[ c ].c_str() );
+        return false;
+    }
+    return swap_in( tmp_fspec, cols, kept, dead, dead_cnt );
+}
+
+// Put the rewritten bucket file (and values file) in place of the old,
+// holding kept records with dead of them erased, and start over with
+// it. Under the exclusive lock.
+bool DiskHashTable::BucketFile::swap_in( const std::string *tmp_fspec, size_t cols, size_t kept, std::vector<uint64_t>& dead, size_t dead_cnt )
+{
+    // Drop the old file's index and filter before the swap, so a crash
+    // leaves them to be rebuilt rather than trusted; its tombstones
+    // name its inode and so can't be mistaken for the new file's.
+    _pool->forget( *this );
+    unmap();
+    std::remove( index_fspec().c_str() );
+    std::remove( bloom_fspec().c_str() );
+    // the values go second; see recover_vals
+    bool swapped = std::rename( tmp_fspec[ 0 ].c_str(), _fspec.c_str() ) == 0;
+    if ( swapped && _split_vals && std::rename( tmp_fspec[ 1 ].c_str(), val_fspec().c_str() ) != 0 )
+        std::cout << "Error replacing bucket values " << val_fspec() << ' ' << errno << std::endl;
+    if ( swapped )
+    {
+        _file_id  = next_file_id++;
+        _reccnt   = kept;
+        _disk_cnt = kept;
+        _pend.clear();
+        _vpend.clear();
+        _mem.clear();
+        _dead.swap( dead );
+        _dead_cnt = dead_cnt;
+        std::remove( dead_fspec().c_str() );
+        _dead_dirty = dead_cnt != 0;
+    }
+    else
+    {
+        std::cout << "Error replacing bucket file " << _fspec << ' ' << errno << std::endl;
+        for ( size_t c(0); c < cols; ++c )
+            std::remove( tmp_fspec[ c ].c_str() );
+    }
+    _bloom.reset();
+    _bloom_dirty = false;
+    _fps.reset();
+    _idx_ready   = false;
+    _idx_dirty   = false;
+    _idx_cap     = 0;
+    _idx_cnt     = 0;
+    prepare_nolock();
+    return swapped;
+}
+
+// Merge the bucket's runs into one, leaving out erased records. As with
+// compact, the merged run goes to <bucket>.compact a chunk at a time
+// under the shared lock, and the last step carries over what changed
+// meanwhile; runs written out since the merge began follow the merged
+// one as they are.
+bool DiskHashTable::BucketFile::merge( const PaceFunc& pace )
+{
+    prepare();
+    std::string tmp_fspec = _fspec + ".compact";
+    int fd = ::open( tmp_fspec.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666 );
+    if ( fd == -1 )
+    {
+        std::cout << "Error creating " << tmp_fspec << ' ' << errno << std::endl;
+        return false;
+    }
+
+    // a cursor reading each run a piece at a time, and a heap of the
+    // runs by the hash of their next record
+    struct Cursor {
+        size_t _next;       // first record not yet read
+        size_t _end;
+        size_t _first;      // record number of the first in _buf
+        size_t _at;
+        size_t _cnt;
+        std::vector<uchar> _buf;
+    };
+    typedef std::pair<uint64_t, size_t> HeapItem;
+    std::vector<Cursor> cur;
+    std::priority_queue<HeapItem, std::vector<HeapItem>, std::greater<HeapItem>> heap;
+    std::vector<size_t> newpos;     // where each old record went, or SIZE_MAX
+    size_t chunk = TABLE_BUFF_SIZE / _reclen;
+    size_t piece(0);
+    size_t upto(0);                 // records being merged
+    size_t kept(0);                 // records in the new file
+
+    auto fill = [&]( size_t c ) {
+        Cursor& cu = cur[ c ];
+        size_t n = std::min( piece, cu._end - cu._next );
+        cu._buf.resize( n * _reclen );
+        if ( n == 0 )
+            return true;
+        if ( !read_at( cu._next * _reclen, n * _reclen, cu._buf.data() ) )
+            return false;
+        cu._first = cu._next;
+        cu._at    = 0;
+        cu._cnt   = n;
+        cu._next += n;
+        heap.emplace( key_hash( cu._buf.data(), _keylen ), c );
+        return true;
+    };
+
+    // take up to a chunk of records off the heap, writing the live ones
+    auto step = [&]( size_t& bytes ) {
+        file_guard fg(*this);
+        ucharptr out = get_file_buff();
+        size_t n(0), taken(0);
+        while ( !heap.empty() && taken < chunk )
+        {
+            size_t c = heap.top().second;
+            heap.pop();
+            Cursor& cu = cur[ c ];
+            size_t r = cu._first + cu._at;
+            if ( !is_dead( r ) )
+            {
+                std::memcpy( out + n * _reclen, cu._buf.data() + cu._at * _reclen, _reclen );
+                newpos[ r ] = kept + n++;
+            }
+            taken++;
+            if ( ++cu._at < cu._cnt )
+                heap.emplace( key_hash( cu._buf.data() + cu._at * _reclen, _keylen ), c );
+            else if ( !fill( c ) )
+                return false;
+        }
+        if ( !write_full( fd, out, n * _reclen, kept * _reclen ) )
+            return false;
+        kept  += n;
+        bytes += ( taken + n ) * _reclen;
+        return true;
+    };
+
+    bool ok;
+    {
+        std::unique_lock<BucketMutex> lock( _mtx );
+        ok = flush_nolock();
+        _compacting = true;
+        _compact_log.clear();
+        upto = _disk_cnt;
+        newpos.assign( upto, SIZE_MAX );
+        piece = std::max<size_t>( 1, chunk / std::max<size_t>( 1, _runs.size() ) );
+        cur.resize( _runs.size() );
+        file_guard fg(*this);
+        for ( size_t c(0); ok && c < _runs.size(); ++c )
+        {
+            cur[ c ]._next = _runs[ c ]._start;
+            cur[ c ]._end  = _runs[ c ]._start + _runs[ c ]._cnt;
+            ok = fill( c );
+        }
+    }
+    while ( ok )
+    {
+        size_t bytes(0);
+        {
+            std::shared_lock<BucketMutex> lock( _mtx );
+            if ( _retired || heap.empty() )
+                break;
+            ok = step( bytes );
+        }
+        ok = ok && pace( bytes );
+    }
+
+    std::unique_lock<BucketMutex> lock( _mtx );
+    _compacting = false;
+    ok = ok && !_retired && flush_nolock();
+    std::vector<uint64_t> dead;
+    size_t dead_cnt(0);
+    auto mark = [&]( size_t at ) {
+        dead.resize( std::max( dead.size(), ( at >> 6 ) + 1 ), 0 );
+        if ( ( dead[ at >> 6 ] >> ( at & 63 ) & 1 ) == 0 )
+            dead_cnt++;
+        dead[ at >> 6 ] |= 1ull << ( at & 63 );
+    };
+    if ( ok )
+    {
+        file_guard fg(*this);
+        size_t bytes(0);
+        while ( ok && !heap.empty() )
+            ok = step( bytes );
+        ucharptr buff = get_file_buff();
+        for ( size_t r = upto; ok && r < _disk_cnt; r += chunk )
+        {
+            size_t n = std::min( chunk, _disk_cnt - r );
+            ok = read_at( r * _reclen, n * _reclen, buff )
+              && write_full( fd, buff, n * _reclen, ( kept + r - upto ) * _reclen );
+        }
+        for ( size_t r : _compact_log )
+        {
+            if ( r >= upto || newpos[ r ] == SIZE_MAX )
+                continue;
+            if ( !is_dead( r ) )
+                ok = ok && read_at( r * _reclen, _reclen, buff ) && write_full( fd, buff, _reclen, newpos[ r ] * _reclen );
+            else
+                mark( newpos[ r ] );
+        }
+        if ( _dead_cnt != 0 )
+            for ( size_t r = upto; r < _reccnt; ++r )
+                if ( is_dead( r ) )
+                    mark( kept + r - upto );
+    }
+    _compact_log.clear();
+    if ( _direct )
+        drop_pages( fd );
+    ok = ::close( fd ) == 0 && ok;
+    if ( !ok )
+    {
+        std::remove( tmp_fspec.c_str() );
+        return false;
+    }
+    return swap_in( &tmp_fspec, 1, kept + _reccnt - upto, dead, dead_cnt );
+}
+
+// Compaction and splitting rename the new bucket file into place, then
+// its values file. A values file whose bucket file is already gone
+// missed its turn, so finish the job; one whose bucket file is still
+// there belongs to a rewrite that never happened.
+void DiskHashTable::BucketFile::recover_vals()
+{
+    for ( const char *ext : { ".compact", ".split" } )
+    {
+        std::string tmp_fspec = _fspec + ext;
+        if ( !std::filesystem::exists( tmp_fspec + ".val" ) )
+            continue;
+        if ( std::filesystem::exists( tmp_fspec ) )
+            std::remove( ( tmp_fspec + ".val" ).c_str() );
+        else
+            std::rename( ( tmp_fspec + ".val" ).c_str(), val_fspec().c_str() );
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// DiskHashTable
+//
+// Default hasher
+// where each count lives in DiskHashTable::counters
+const size_t CTR_HITS   = 0;
+const size_t CTR_MISSES = 1;
+const size_t CTR_OPS    = 2;                            // one per DhtOp
+const size_t CTR_OP_NS  = CTR_OPS + DHT_OP_CNT;         // likewise
+const size_t CTR_HIST   = CTR_OP_NS + DHT_OP_CNT;       // LAT_BUCKETS per DhtOp
+const size_t CTR_CNT    = CTR_HIST + DHT_OP_CNT * LAT_BUCKETS;
+
+DiskHashTable::DiskHashTable()
+: keyscan(nullptr)
+, reccnt(0)
+, clean(false)
+, compact_stop(false)
+, compacting(0)
+, counters(CTR_CNT)
+, retired{}
+{}
+
+DiskHashTable::op_timer::op_timer( DiskHashTable& dht, DhtOp op )
+: _dht(dht)
+, _op(op)
+{
+    if ( _dht.options.latency_stats )
+        _t0 = std::chrono::steady_clock::now();
+}
+
+DiskHashTable::op_timer::~op_timer()
+{
+    _dht.counters.add( CTR_OPS + _op );
+    if ( !_dht.options.latency_stats )
+        return;
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - _t0 ).count();
+    _dht.counters.add( CTR_OP_NS + _op, ns );
+    _dht.counters.add( CTR_HIST + _op * LAT_BUCKETS + ShardedCounters::lat_bucket( ns ) );
+}
+
+bool DiskHashTable::open(
+    const std::string  path_name,
+    const std::string  base_name,
+    size_t             key_len,
+    size_t             val_len,
+    dht_comparitor     comp_func,
+    dht_hasher         hash_func,
+    const DhtOptions&  opts
+) {
+    if ( !buckets.empty() )
+        close();
+    name     = base_name;
+    keylen   = key_len;
+    vallen   = val_len;
+    reclen   = key_len + val_len;
+    reccnt   = 0;
+    compfunc = comp_func;
+    hashfunc = hash_func;
+    options  = opts;
+    reset_stats();
+    if ( opts.max_open_files < 0 )
+        fpool.resize( 0 );
+    else if ( opts.max_open_files > 0 )
+        fpool.resize( opts.max_open_files );
+
+    std::stringstream ss;
+    ss << path_name << '/' << name << '/';
+    path = ss.str();
+    std::filesystem::create_directories( path );
+
+    // the header decides the hasher for the built-in kinds; a table
+    // with buckets but no header predates it and is MD5 addressed
+    TableHeader hdr;
+    std::vector<uint64_t> counts;
+    if ( read_header( hdr, counts ) )
+    {
+        if ( hdr._keylen != keylen || hdr._vallen != vallen )
+        {
+            std::cout << "Table " << path << name << " has key/value lengths "
+                      << hdr._keylen << '/' << hdr._vallen << ", not "
+                      << keylen << '/' << vallen << std::endl;
+            return false;
+        }
+        hashkind = (DhtHashKind)hdr._hash_kind;
+        options.split_values = ( hdr._flags & TABLE_FLAG_SPLIT_VALUES ) != 0;
+        options.sorted_runs  = ( hdr._flags & TABLE_FLAG_SORTED_RUNS ) != 0;
+        base_cnt = hdr._base_cnt;
+        level    = hdr._level;
+        split    = hdr._split;
+    }
+    else
+    {
+        bool legacy = false;
+        for ( auto& entry : std::filesystem::directory_iterator( path ) )
+            if ( entry.path().filename().string().starts_with( name + '_' ) )
+                legacy = true;
+        if ( hash_func == default_hasher )
+            hashkind = legacy ? DHT_HASH_MD5 : DHT_HASH_FAST;
+        else if ( hash_func == md5_hasher )
+            hashkind = DHT_HASH_MD5;
+        else
+            hashkind = DHT_HASH_CUSTOM;
+        options.sorted_runs  = opts.sorted_runs && !legacy;
+        options.split_values = opts.split_values && !legacy && vallen != 0 && !options.sorted_runs;
+        base_cnt = 1;
+        while ( base_cnt < ( ( legacy || opts.bucket_count == 0 ) ? BUCKET_HI : opts.bucket_count ) )
+            base_cnt <<= 1;
+        level = 0;
+        split = 0;
+    }
+
+    // sorted runs find records their own way
+    if ( options.sorted_runs )
+    {
+        options.use_index        = false;
+        options.fingerprint_bits = 0;
+    }
+    // direct I/O goes around the mapping too, where it can be had at all
+    if ( options.direct_io )
+    {
+        std::string probe = path + name + ".direct";
+        int fd = ::open( probe.c_str(), O_RDWR | O_CREAT | O_DIRECT, 0666 );
+        if ( fd == -1 )
+        {
+            std::cout << "Direct I/O unavailable under " << path << ' ' << errno << " - using the page cache" << std::endl;
+            options.direct_io = false;
+        }
+        else
+        {
+            ::close( fd );
+            std::remove( probe.c_str() );
+            options.use_mmap = false;
+        }
+    }
+
+    if ( hashkind == DHT_HASH_FAST )
+        hashfunc = default_hasher;
+    else if ( hashkind == DHT_HASH_MD5 )
+        hashfunc = md5_hasher;
+
+    if ( opts.cache_records != 0 )
+        cache = std::make_unique<RecordCache>( opts.cache_records, keylen, vallen );
+    if ( opts.async_io )
+        aio = std::make_unique<AsyncIO>( opts.async_depth, opts.async_uring );
+    if ( options.direct_io && opts.direct_cache_bytes >= DIRECT_ALIGN )
+        blocks = std::make_unique<RecordCache>( opts.direct_cache_bytes / DIRECT_ALIGN, 2 * sizeof(uint64_t), DIRECT_ALIGN );
+    keyscan = ( compfunc == default_comparitor ) ? key_scanner( keylen ) : nullptr;
+
+    // Set up every bucket now, so the directory never changes under
+    // a lookup. With a current manifest this doesn't touch the disk;
+    // otherwise each bucket's count comes from the size of its file.
+    size_t cnt = ( base_cnt << level ) + split;
+    buckets.assign( cnt, nullptr );
+    if ( counts.size() != 2 * cnt )
+        counts.clear();
+    for ( size_t i(0); i < cnt; ++i )
+    {
+        BucketFilePtr bp = counts.empty() ? load_bucket( i )
+                                          : load_bucket( i, counts[ i ], counts[ cnt + i ] );
+        reccnt += bp->live();
+    }
+
+    // the manifest stays current until the first change
+    clean = !counts.empty();
+    bool ok = clean || write_header();
+    if ( opts.compact_ratio > 0 || ( options.sorted_runs && opts.max_runs != 0 ) )
+    {
+        compact_stop = false;
+        compactor = std::thread( &DiskHashTable::compact_loop, this );
+    }
+    return ok;
+}
+
+// Flush everything and record each bucket's count in the manifest.
+// Operations may continue afterwards.
+bool DiskHashTable::checkpoint()
+{
+    std::unique_lock<BRLock> lock( dir_lock );
+    if ( buckets.empty() )
+        return false;
+    bool ok = true;
+    for ( auto& bp : buckets )
+        ok = bp->flush() && ok;
+    // a bucket part way through compaction will change its count, and
+    // the manifest was marked stale when it started
+    if ( compacting != 0 )
+        return ok;
+    std::lock_guard<std::mutex> hdr_lock( hdr_mtx );
+    clean = ok && write_header( true );
+    return clean;
+}
+
+// checkpoint, then close every bucket; the table must be opened again
+// before further use
+bool DiskHashTable::close()
+{
+    if ( buckets.empty() )
+        return true;
+    drain_async();
+    stop_compactor();
+    bool ok = checkpoint();
+    std::unique_lock<BRLock> lock( dir_lock );
+    buckets.clear();
+    cache.reset();
+    blocks.reset();
+    aio.reset();
+    reccnt = 0;
+    return ok;
+}
+
+// The first change after a checkpoint marks the manifest stale before
+// anything reaches a bucket, so a crash can't leave it looking current.
+void DiskHashTable::mark_dirty()
+{
+    if ( !clean.load( std::memory_order_acquire ) )
+        return;
+    std::lock_guard<std::mutex> lock( hdr_mtx );
+    if ( clean )
+    {
+        write_header();
+        clean.store( false, std::memory_order_release );
+    }
+}
+
+bool DiskHashTable::read_header( TableHeader& hdr, std::vector<uint64_t>& counts )
+{
+    std::FILE *fp = std::fopen( ( path + name + ".dht" ).c_str(), "r" );
+    if ( fp == nullptr )
+        return false;
+    std::memset( &hdr, 0, sizeof(hdr) );
+    // the manifest follows a header of its version's length
+    size_t len  = std::fread( &hdr, 1, offsetof( TableHeader, _flags ), fp );
+    size_t want = offsetof( TableHeader, _flags );
+    if ( len == want && hdr._version >= 3 )
+    {
+        len  += std::fread( &hdr._flags, 1, sizeof(hdr._flags), fp );
+        want += sizeof(hdr._flags);
+    }
+    TableManifest mft;
+    if ( len == want
+      && std::fread( &mft, sizeof(mft), 1, fp ) == 1
+      && mft._magic == MANIFEST_MAGIC && mft._clean != 0
+      && mft._count_cnt == hdr._bucket_cnt )
+    {
+        counts.resize( 2 * mft._count_cnt );
+        if ( std::fread( counts.data(), sizeof(uint64_t), counts.size(), fp ) != counts.size() )
+            counts.clear();
+    }
+    std::fclose( fp );
+    if ( len < offsetof( TableHeader, _base_cnt )
+      || hdr._magic != TABLE_MAGIC
+      || hdr._version == 0 || hdr._version > TABLE_VERSION )
+        return false;
+    if ( hdr._version == 1 )
+        hdr._base_cnt = hdr._bucket_cnt;
+    return hdr._base_cnt != 0 && ( hdr._base_cnt & ( hdr._base_cnt - 1 ) ) == 0;
+}
+
+// Write the header, and with_counts a current manifest. Callers hold
+// dir_lock, so the bucket counts are settled.
+bool DiskHashTable::write_header( bool with_counts )
+{
+    // tables without flags stay readable by version 2 code
+    uint32_t flags = ( options.split_values ? TABLE_FLAG_SPLIT_VALUES : 0 )
+                   | ( options.sorted_runs  ? TABLE_FLAG_SORTED_RUNS  : 0 );
+    TableHeader hdr{ TABLE_MAGIC, flags ? TABLE_VERSION : 2u, hashkind, (uint32_t)buckets.size(), keylen, vallen,
+                     base_cnt, (uint32_t)level, split, flags };
+    size_t hdr_len = flags ? sizeof(hdr) : offsetof( TableHeader, _flags );
+    TableManifest mft{ MANIFEST_MAGIC, with_counts, with_counts ? buckets.size() : 0 };
+    std::vector<uint64_t> counts;
+    if ( with_counts )
+    {
+        for ( auto& bp : buckets )
+            counts.push_back( bp->_reccnt );
+        for ( auto& bp : buckets )
+            counts.push_back( bp->_dead_cnt );
+    }
+    // write-and-rename so a crash never leaves a torn header
+    std::string fspec = path + name + ".dht";
+    std::FILE *fp = std::fopen( ( fspec + ".tmp" ).c_str(), "w" );
+    if ( fp == nullptr )
+    {
+        std::cout << "Error writing table header " << fspec << ' ' << errno << std::endl;
+        return false;
+    }
+    bool ok = std::fwrite( &hdr, hdr_len, 1, fp ) == 1
+           && std::fwrite( &mft, sizeof(mft), 1, fp ) == 1
+           && std::fwrite( counts.data(), sizeof(uint64_t), counts.size(), fp ) == counts.size();
+    ok = std::fclose( fp ) == 0 && ok;
+    return ok && std::rename( ( fspec + ".tmp" ).c_str(), fspec.c_str() ) == 0;
+}
+
+// Whether bucket, which the caller has just added to, has grown past
+// the split threshold. Call under dir_lock.
+bool DiskHashTable::split_due( size_t bucket )
+{
+    return options.split_threshold != 0 && buckets[ bucket ]->live() > options.split_threshold;
+}
+
+// If bucket is (still) over the split threshold, split the bucket at
+// the split pointer. Linear hashing splits buckets in order rather than
+// the one that overflowed, which keeps addressing to a single pointer;
+// the overflowing bucket gets its turn within the round.
+//
+// Splitting moves records between buckets, so it has the table to
+// itself; call without holding dir_lock.
+void DiskHashTable::maybe_split( size_t bucket )
+{
+    std::unique_lock<BRLock> lock( dir_lock );
+    if ( split_due( bucket ) )
+        split_next();
+}
+
+bool DiskHashTable::split_next()
+{
+    size_t lo_cnt = base_cnt << level;
+    size_t old_id = split;
+    size_t new_id = old_id + lo_cnt;
+    size_t mask   = ( lo_cnt << 1 ) - 1;
+    std::string old_fspec = get_bucket_fspec( old_id );
+    std::string new_fspec = get_bucket_fspec( new_id );
+    std::string tmp_fspec = old_fspec + ".split";
+
+    // write both halves out before anything becomes visible
+    BucketFilePtr old_bp = buckets[ old_id ];
+    std::unique_lock<BucketMutex> old_lock( old_bp->_mtx );
+    old_bp->flush_nolock();
+    bool split_vals = old_bp->_split_vals;
+    size_t stride   = old_bp->_stride;
+    if ( old_bp->_reccnt != 0 )
+    {
+        // [0] stays, [1] moves; with split values, their values too
+        std::FILE *out[2]  = { std::fopen( tmp_fspec.c_str(), "w" ), std::fopen( new_fspec.c_str(), "w" ) };
+        std::FILE *vout[2] = { nullptr, nullptr };
+        if ( split_vals )
+        {
+            vout[0] = std::fopen( ( tmp_fspec + ".val" ).c_str(), "w" );
+            vout[1] = std::fopen( ( new_fspec + ".val" ).c_str(), "w" );
+        }
+        bool ok = out[0] != nullptr && out[1] != nullptr
+               && ( !split_vals || ( vout[0] != nullptr && vout[1] != nullptr ) );
+        if ( ok )
+        {
+            BucketFile::file_guard fg( *old_bp );
+            std::vector<uchar> vals;
+            old_bp->scan_blocks_nolock( 0, [&]( ucharptr_c recs, size_t first, size_t cnt ) {
+                if ( split_vals )
+                {
+                    vals.resize( cnt * vallen );
+                    ok = old_bp->read_at( first * vallen, vals.size(), vals.data(), true );
+                }
+                for ( size_t i(0); i < cnt && ok; ++i )
+                {
+                    if ( old_bp->is_dead( first + i ) )
+                        continue;
+                    ucharptr_c p = recs + i * stride;
+                    int side = ( ( hashfunc( p, keylen ) & mask ) == old_id ) ? 0 : 1;
+                    ok = std::fwrite( p, stride, 1, out[ side ] ) == 1
+                      && ( !split_vals || std::fwrite( vals.data() + i * vallen, vallen, 1, vout[ side ] ) == 1 );
+                }
+                return !ok;
+            });
+        }
+        for ( std::FILE *fp : { out[0], out[1], vout[0], vout[1] } )
+        {
+            if ( fp == nullptr )
+                continue;
+            if ( options.direct_io && std::fflush( fp ) == 0 )
+                drop_pages( fileno( fp ) );
+            ok = std::fclose( fp ) == 0 && ok;
+        }
+        if ( !ok )
+        {
+            std::cout << "Error splitting bucket " << old_fspec << ' ' << errno << std::endl;
+            for ( auto& fspec : { tmp_fspec, new_fspec, tmp_fspec + ".val", new_fspec + ".val" } )
+                std::remove( fspec.c_str() );
+            return false;
+        }
+        // the sidecars describe the old contents
+        old_bp->_bloom_dirty = false;
+        old_bp->_dead_dirty  = false;
+    }
+    else
+    {
+        // nothing to move, but clear out any leftovers of an earlier attempt
+        std::remove( new_fspec.c_str() );
+        std::remove( ( new_fspec + ".val" ).c_str() );
+    }
+
+    // Publish the new bucket before shrinking the old one. If we stop
+    // between the two, the moved records are still reachable through
+    // the new bucket and merely duplicated in the old.
+    buckets.push_back( nullptr );
+    if ( ++split == lo_cnt )
+    {
+        level++;
+        split = 0;
+    }
+    write_header();
+
+    // a compaction still holding the old bucket must leave it be
+    old_bp->_retired = true;
+    old_lock.unlock();
+    add_stats( retired, old_bp->stats() );
+    buckets[ old_id ] = nullptr;
+    old_bp = nullptr;
+    for ( auto& fspec : { old_fspec, new_fspec } )
+    {
+        std::remove( ( fspec + ".idx" ).c_str() );
+        std::remove( ( fspec + ".blm" ).c_str() );
+        std::remove( ( fspec + ".del" ).c_str() );
+    }
+    // the values go second; see BucketFile::recover_vals
+    if ( std::filesystem::exists( tmp_fspec ) )
+    {
+        std::rename( tmp_fspec.c_str(), old_fspec.c_str() );
+        if ( split_vals )
+            std::rename( ( tmp_fspec + ".val" ).c_str(), ( old_fspec + ".val" ).c_str() );
+    }
+    load_bucket( old_id );
+    load_bucket( new_id );
+    return true;
+}
+
+DiskHashTable::~DiskHashTable()
+{
+    close();
+}
+
+size_t DiskHashTable::calc_bucket_id( ucharptr_c key )
+{
+    return bucket_for_hash( hashfunc( key, keylen ) );
+}
+
+size_t DiskHashTable::bucket_for_hash( uint64_t hash ) const
+{
+    size_t   lo_cnt = base_cnt << level;
+    size_t   bucket = hash & ( lo_cnt - 1 );
+    // buckets before the split pointer have already been split this round
+    if ( bucket < split )
+        bucket = hash & ( ( lo_cnt << 1 ) - 1 );
+    return bucket;
+}
+
+bool DiskHashTable::search( ucharptr_c key, ucharptr val )
+{
+    op_timer timer( *this, DHT_OP_SEARCH );
+    bool found = cache && cache->get( key, val );
+    if ( !found )
+    {
+        std::shared_lock<BRLock> lock( dir_lock );
+        found = buckets[ calc_bucket_id( key ) ]->search( key, val ) != -1;
+    }
+    counters.add( found ? CTR_HITS : CTR_MISSES );
+    return found;
+}
+
+bool DiskHashTable::insert( ucharptr_c key, ucharptr_c val )
+{
+    return find_or_insert( key, val ) == DHT_INSERTED;
+}
+
+// A cached key is known to be there, so needs no lock at all.
+DhtResult DiskHashTable::find_or_insert( ucharptr_c key, ucharptr_c val, ucharptr existing )
+{
+    op_timer timer( *this, DHT_OP_INSERT );
+    if ( cache && cache->get( key, existing ) )
+        return DHT_FOUND;
+    size_t    bucket;
+    DhtResult res;
+    bool      due;
+    {
+        std::shared_lock<BRLock> lock( dir_lock );
+        mark_dirty();
+        bucket = calc_bucket_id( key );
+        res = buckets[ bucket ]->find_or_insert( key, val, existing );
+        due = res == DHT_INSERTED && split_due( bucket );
+    }
+    if ( res == DHT_INSERTED )
+        reccnt++;
+    if ( due )
+        maybe_split( bucket );
+    return res;
+}
+
+DhtResult DiskHashTable::upsert( ucharptr_c key, ucharptr_c val )
+{
+    op_timer timer( *this, DHT_OP_UPSERT );
+    size_t    bucket;
+    DhtResult res;
+    bool      due;
+    {
+        std::shared_lock<BRLock> lock( dir_lock );
+        mark_dirty();
+        bucket = calc_bucket_id( key );
+        res = buckets[ bucket ]->upsert( key, val );
+        due = res == DHT_INSERTED && split_due( bucket );
+    }
+    if ( res == DHT_INSERTED )
+        reccnt++;
+    if ( due )
+        maybe_split( bucket );
+    return res;
+}
+
+bool DiskHashTable::append( ucharptr_c key, ucharptr_c val )
+{
+    op_timer timer( *this, DHT_OP_APPEND );
+    size_t bucket;
+    bool   due;
+    {
+        std::shared_lock<BRLock> lock( dir_lock );
+        mark_dirty();
+        bucket = calc_bucket_id( key );
+        if ( !buckets[ bucket ]->append( key, val ) )
+            return false;
+        due = split_due( bucket );
+    }
+    reccnt++;
+    if ( due )
+        maybe_split( bucket );
+    return true;
+}
+
+bool DiskHashTable::update( ucharptr_c key, ucharptr_c val )
+{
+    op_timer timer( *this, DHT_OP_UPDATE );
+    std::shared_lock<BRLock> lock( dir_lock );
+    mark_dirty();
+    return buckets[ calc_bucket_id( key ) ]->update( key, val );
+}
+
+bool DiskHashTable::erase( ucharptr_c key )
+{
+    op_timer timer( *this, DHT_OP_ERASE );
+    bool due;
+    {
+        std::shared_lock<BRLock> lock( dir_lock );
+        mark_dirty();
+        BucketFilePtr& bp = buckets[ calc_bucket_id( key ) ];
+        if ( !bp->erase( key ) )
+            return false;
+        due = options.compact_ratio > 0 && bp->compact_due( options.compact_ratio );
+    }
+    reccnt--;
+    if ( due )
+        compact_cv.notify_one();
+    return true;
+}
+
+// write out every bucket's buffered appends and tombstones
+bool DiskHashTable::flush()
+{
+    std::shared_lock<BRLock> lock( dir_lock );
+    bool ok = true;
+    for ( auto& bp : buckets )
+        ok = bp->flush() && ok;
+    return ok;
+}
+
+// Pass every record to fn, in runs of whole records, with the buckets
+// shared out among threads workers (0 for one per core). fn is called
+// from several threads at once. Splits wait until the pass is over, so
+// fn must not insert into this table.
+void DiskHashTable::scan_parallel( const BlockFunc& fn, unsigned threads )
+{
+    std::shared_lock<BRLock> lock( dir_lock );
+    if ( threads == 0 )
+        threads = std::max( 1u, std::thread::hardware_concurrency() );
+    threads = std::min<size_t>( threads, buckets.size() );
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for ( size_t b; ( b = next.fetch_add( 1, std::memory_order_relaxed ) ) < buckets.size(); )
+            buckets[ b ]->scan_blocks( fn );
+    };
+    std::vector<std::thread> pool;
+    for ( unsigned i(1); i < threads; ++i )
+        pool.emplace_back( worker );
+    worker();
+    for ( auto& t : pool )
+        t.join();
+}
+
+// Check that no key is in the table twice and that every key is in the
+// bucket it hashes to, with the buckets shared out among threads
+// workers (0 for one per core). A key can only be in its own bucket, so
+// each is checked on its own, against a flat hash set of its keys - a
+// worker holds one bucket's set at a time.
+DhtVerifyStats DiskHashTable::verify( unsigned threads )
+{
+    std::shared_lock<BRLock> lock( dir_lock );
+    DhtVerifyStats st{};
+    st._buckets = buckets.size();
+    if ( buckets.empty() )
+        return st;
+    if ( threads == 0 )
+        threads = std::max( 1u, std::thread::hardware_concurrency() );
+    threads = std::min<size_t>( threads, buckets.size() );
+    std::vector<uint64_t> sizes( buckets.size() );
+    std::atomic<uint64_t> dupes{0};
+    std::atomic<uint64_t> misplaced{0};
+    std::atomic<size_t>   next{0};
+    auto worker = [&]() {
+        std::vector<uchar>    keys;     // the bucket's distinct keys
+        std::vector<uint64_t> slots;    // index into keys + 1, 0 if empty
+        size_t cap(0);
+        auto place = [&]( ucharptr_c key, uint64_t hash ) -> uint64_t& {
+            size_t s = ( hash * 0x9e3779b97f4a7c15ull ) >> ( 64 - std::countr_zero( cap ) );
+            while ( slots[ s ] != 0 && !compfunc( keys.data() + ( slots[ s ] - 1 ) * keylen, key, keylen ) )
+                s = ( s + 1 ) & ( cap - 1 );
+            return slots[ s ];
+        };
+        for ( size_t b; ( b = next.fetch_add( 1, std::memory_order_relaxed ) ) < buckets.size(); )
+        {
+            BucketFile& bf = *buckets[ b ];
+            cap = 16;
+            while ( cap < bf.live() * 2 )
+                cap <<= 1;
+            slots.assign( cap, 0 );
+            keys.clear();
+            uint64_t cnt(0), dup(0), away(0);
+            bf.scan_blocks( [&]( ucharptr_c recs, size_t n ) {
+                const uchar *p = recs;
+                for ( size_t i(0); i < n; ++i, p += reclen )
+                {
+                    uint64_t hash = hashfunc( p, keylen );
+                    cnt++;
+                    if ( bucket_for_hash( hash ) != b )
+                        away++;
+                    uint64_t& slot = place( (ucharptr)p, hash );
+                    if ( slot != 0 )
+                    {
+                        dup++;
+                        continue;
+                    }
+                    keys.insert( keys.end(), p, p + keylen );
+                    slot = keys.size() / keylen;
+                    // appended since the set was sized
+                    if ( slot * 2 > cap )
+                    {
+                        cap <<= 1;
+                        slots.assign( cap, 0 );
+                        for ( size_t k(0); k < slot; ++k )
+                        {
+                            ucharptr key = keys.data() + k * keylen;
+                            place( key, hashfunc( key, keylen ) ) = k + 1;
+                        }
+                    }
+                }
+            });
+            sizes[ b ] = cnt;
+            dupes     += dup;
+            misplaced += away;
+        }
+    };
+    std::vector<std::thread> pool;
+    for ( unsigned i(1); i < threads; ++i )
+        pool.emplace_back( worker );
+    worker();
+    for ( auto& t : pool )
+        t.join();
+
+    st._duplicates = dupes;
+    st._misplaced  = misplaced;
+    st._min        = sizes[ 0 ];
+    for ( size_t b(0); b < sizes.size(); ++b )
+    {
+        st._records += sizes[ b ];
+        if ( sizes[ b ] < st._min )
+        {
+            st._min        = sizes[ b ];
+            st._min_bucket = b;
+        }
+        if ( sizes[ b ] > st._max )
+        {
+            st._max        = sizes[ b ];
+            st._max_bucket = b;
+        }
+    }
+    st._mean = (double)st._records / sizes.size();
+    double var(0);
+    for ( uint64_t n : sizes )
+        var += ( n - st._mean ) * ( n - st._mean );
+    st._stddev = std::sqrt( var / sizes.size() );
+    return st;
+}
+
+// Rewrite every bucket with at least min_ratio of its records erased
+// (any, for 0) without them, and return how many were. The rest of the
+// table carries on meanwhile, as do lookups in the bucket being
+// rewritten.
+size_t DiskHashTable::compact( double min_ratio )
+{
+    return compact_pass( min_ratio, 0 );
+}
+
+// One pass over the buckets, for compact() or the background thread,
+// copying no faster than bytes_per_sec unless that is 0. Gives up when
+// the table closes.
+size_t DiskHashTable::compact_pass( double min_ratio, size_t bytes_per_sec )
+{
+    std::lock_guard<std::mutex> pass( compact_mtx );
+    auto     start = std::chrono::steady_clock::now();
+    uint64_t spent(0);
+    auto pace = [&]( size_t bytes ) {
+        if ( bytes_per_sec == 0 )
+            return !compact_stop;
+        spent += bytes;
+        auto until = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                 std::chrono::duration<double>( (double)spent / bytes_per_sec ) );
+        std::unique_lock<std::mutex> lock( compact_cv_mtx );
+        return !compact_cv.wait_until( lock, until, [&]{ return compact_stop.load(); } );
+    };
+    size_t done(0);
+    for ( size_t b(0); !compact_stop; ++b )
+    {
+        BucketFilePtr bp;
+        {
+            std::shared_lock<BRLock> lock( dir_lock );
+            if ( b >= buckets.size() )
+                break;
+            if ( !buckets[ b ]->compact_due( min_ratio ) )
+                continue;
+            bp = buckets[ b ];
+            compacting++;
+            mark_dirty();
+        }
+        if ( bp->compact( pace ) )
+            done++;
+        compacting--;
+    }
+    return done;
+}
+
+// background compaction, woken by erase() or every COMPACT_POLL_MS
+void DiskHashTable::compact_loop()
+{
+    std::unique_lock<std::mutex> lock( compact_cv_mtx );
+    while ( !compact_stop )
+    {
+        compact_cv.wait_for( lock, std::chrono::milliseconds( COMPACT_POLL_MS ) );
+        if ( compact_stop )
+            break;
+        lock.unlock();
+        // running only to merge sorted runs, erasures alone never qualify
+        compact_pass( ( options.compact_ratio > 0 ) ? options.compact_ratio : 2, options.compact_bytes_per_sec );
+        lock.lock();
+    }
+}
+
+void DiskHashTable::stop_compactor()
+{
+    if ( !compactor.joinable() )
+        return;
+    {
+        std::lock_guard<std::mutex> lock( compact_cv_mtx );
+        compact_stop = true;
+    }
+    compact_cv.notify_all();
+    compactor.join();
+}
+
+// The queue is made on first use, with async_depth workers. Closing
+// drains it; a done callback queueing more work then just starts
+// another, drained in turn.
+void DiskHashTable::search_async( ucharptr_c key, ucharptr val, AsyncDone done )
+{
+    std::vector<uchar> k( key, key + keylen );
+    std::lock_guard<std::mutex> lock( async_mtx );
+    if ( !async_ops )
+        async_ops = std::make_unique<WorkQueue>( options.async_depth );
+    async_ops->push( [this, k = std::move( k ), val, done = std::move( done )] () mutable {
+        done( search( k.data(), val ) ? DHT_FOUND : DHT_MISSING );
+    });
+}
+
+void DiskHashTable::insert_async( ucharptr_c key, ucharptr_c val, AsyncDone done )
+{
+    std::vector<uchar> k( key, key + keylen );
+    std::vector<uchar> v;
+    if ( val != nullptr )
+        v.assign( val, val + vallen );
+    std::lock_guard<std::mutex> lock( async_mtx );
+    if ( !async_ops )
+        async_ops = std::make_unique<WorkQueue>( options.async_depth );
+    async_ops->push( [this, k = std::move( k ), v = std::move( v ), done = std::move( done )] () mutable {
+        done( find_or_insert( k.data(), v.empty() ? nullptr : v.data() ) );
+    });
+}
+
+void DiskHashTable::wait_async()
+{
+    WorkQueue *q;
+    {
+        std::lock_guard<std::mutex> lock( async_mtx );
+        q = async_ops.get();
+    }
+    if ( q != nullptr )
+        q->wait();
+}
+
+void DiskHashTable::drain_async()
+{
+    while ( true )
+    {
+        std::unique_ptr<WorkQueue> q;
+        {
+            std::lock_guard<std::mutex> lock( async_mtx );
+            q = std::move( async_ops );
+        }
+        if ( !q )
+            return;
+        q.reset();
+    }
+}
+
+size_t DiskHashTable::bucket_count()
+{
+    std::shared_lock<BRLock> lock( dir_lock );
+    return buckets.size();
+}
+
+// group key indexes by bucket id
+DiskHashTable::BucketGroups DiskHashTable::group_by_bucket( size_t n, ucharptr_c keys )
+{
+    BucketGroups groups;
+    for ( size_t i(0); i < n; ++i )
+        groups[ calc_bucket_id( keys + i * keylen ) ].push_back( i );
+    return groups;
+}
+
+size_t DiskHashTable::search_batch( size_t n, ucharptr_c keys, ucharptr vals, DhtResult *results )
+{
+    std::shared_lock<BRLock> lock( dir_lock );
+    size_t found(0);
+    for ( auto& [bucket, items] : group_by_bucket( n, keys ) )
+        found += buckets[ bucket ]->search_batch( items, keys, vals, results );
+    counters.add( CTR_OPS + DHT_OP_SEARCH, n );
+    counters.add( CTR_HITS, found );
+    counters.add( CTR_MISSES, n - found );
+    return found;
+}
+
+void DiskHashTable::prefetch( size_t n, ucharptr_c keys )
+{
+    std::shared_lock<BRLock> lock( dir_lock );
+    for ( auto& [bucket, items] : group_by_bucket( n, keys ) )
+        buckets[ bucket ]->prefetch( items, keys );
+}
+
+size_t DiskHashTable::search_many( size_t n, ucharptr_c keys, ucharptr vals, DhtResult *results )
+{
+    std::shared_lock<BRLock> lock( dir_lock );
+    BucketGroups groups = group_by_bucket( n, keys );
+    auto ahead = groups.begin();    // the next group to hint
+    size_t done(0), hinted(0), found(0);
+    for ( auto& [bucket, items] : groups )
+    {
+        for ( ; ahead != groups.end() && hinted <= done + PREFETCH_AHEAD; ++ahead, ++hinted )
+            buckets[ ahead->first ]->prefetch( ahead->second, keys );
+        found += buckets[ bucket ]->search_batch( items, keys, vals, results );
+        done++;
+    }
+    counters.add( CTR_OPS + DHT_OP_SEARCH, n );
+    counters.add( CTR_HITS, found );
+    counters.add( CTR_MISSES, n - found );
+    return found;
+}
+
+size_t DiskHashTable::insert_batch( size_t n, ucharptr_c keys, ucharptr_c vals, DhtResult *results )
+{
+    size_t inserted(0);
+    // splitting mid-batch would invalidate the grouping, so wait
+    std::vector<size_t> due;
+    {
+        std::shared_lock<BRLock> lock( dir_lock );
+        mark_dirty();
+        for ( auto& [bucket, items] : group_by_bucket( n, keys ) )
+        {
+            inserted += buckets[ bucket ]->insert_batch( items, keys, vals, results );
+            if ( split_due( bucket ) )
+                due.push_back( bucket );
+        }
+    }
+    reccnt += inserted;
+    counters.add( CTR_OPS + DHT_OP_INSERT, n );
+    for ( size_t bucket : due )
+        maybe_split( bucket );
+    return inserted;
+}
+
+size_t DiskHashTable::update_batch( size_t n, ucharptr_c keys, ucharptr_c vals, DhtResult *results )
+{
+    std::shared_lock<BRLock> lock( dir_lock );
+    mark_dirty();
+    size_t updated(0);
+    for ( auto& [bucket, items] : group_by_bucket( n, keys ) )
+        updated += buckets[ bucket ]->update_batch( items, keys, vals, results );
+    counters.add( CTR_OPS + DHT_OP_UPDATE, n );
+    return updated;
+}
+
+// Set up the BucketFile for the given bucket, which touches nothing on
+// disk if rec_cnt is known. Only called while nobody else can see the
+// directory - at open, or from a split.
+DiskHashTable::BucketFilePtr DiskHashTable::load_bucket( size_t bucket, long rec_cnt, long dead_cnt )
+{
+    BucketFilePtr bf = std::make_shared<BucketFile>( fpool, get_bucket_fspec( bucket ), keylen, vallen, compfunc, options, rec_cnt, dead_cnt );
+    bf->_cache   = cache.get();
+    bf->_blocks  = blocks.get();
+    bf->_aio     = aio.get();
+    bf->_keyscan = keyscan;
+    buckets[ bucket ] = bf;
+    return bf;
+}
+
+DhtBloomStats DiskHashTable::bloom_stats()
+{
+    std::shared_lock<BRLock> dir( dir_lock );
+    DhtBloomStats st{};
+    double fpr_sum = 0;
+    for ( auto& bp : buckets )
+    {
+        std::shared_lock<BucketMutex> lock( bp->_mtx );
+        if ( !bp->_bloom )
+            continue;
+        st._buckets++;
+        st._bytes           += bp->_bloom->bytes();
+        st._keys            += bp->_bloom->count();
+        st._negatives       += bp->_bloom_negatives;
+        st._false_positives += bp->_bloom_false_pos;
+        fpr_sum             += bp->_bloom->fpr() * bp->_bloom->count();
+    }
+    if ( st._keys != 0 )
+        st._fpr = fpr_sum / st._keys;
+    return st;
+}
+
+// scan kernel for memcmp keys of key_len bytes; dht<K,V> supplies one
+// built for its key type instead
+key_scan_fn DiskHashTable::key_scanner( size_t key_len )
+{
+    return key_scan_for( key_len );
+}
+
+RecordCacheStats DiskHashTable::cache_stats()
+{
+    return cache ? cache->stats() : RecordCacheStats{};
+}
+
+// everything counted since the table was opened or reset_stats(), and
+// per bucket too if asked
+DhtStats DiskHashTable::stats( bool per_bucket )
+{
+    DhtStats st{};
+    for ( size_t op(0); op < DHT_OP_CNT; ++op )
+    {
+        st._ops[ op ]._count    = counters.get( CTR_OPS + op );
+        st._ops[ op ]._total_ns = counters.get( CTR_OP_NS + op );
+        for ( size_t b(0); b < LAT_BUCKETS; ++b )
+            st._ops[ op ]._hist[ b ] = counters.get( CTR_HIST + op * LAT_BUCKETS + b );
+    }
+    st._hits   = counters.get( CTR_HITS );
+    st._misses = counters.get( CTR_MISSES );
+    {
+        std::shared_lock<BRLock> lock( dir_lock );
+        st._total = retired;
+        for ( auto& bp : buckets )
+        {
+            DhtBucketStats bs = bp->stats();
+            add_stats( st._total, bs );
+            if ( per_bucket )
+                st._buckets.push_back( bs );
+        }
+    }
+    st._files = fpool.stats();
+    st._bloom = bloom_stats();
+    st._cache = cache_stats();
+    if ( blocks )
+        st._blocks = blocks->stats();
+    return st;
+}
+
+void DiskHashTable::reset_stats()
+{
+    std::unique_lock<BRLock> lock( dir_lock );
+    counters.reset();
+    retired = DhtBucketStats{};
+    for ( auto& bp : buckets )
+    {
+        bp->_scanned       = 0;
+        bp->_bytes_read    = 0;
+        bp->_bytes_written = 0;
+        bp->_opens         = 0;
+        bp->_mtx._waits    = 0;
+        bp->_mtx._wait_ns  = 0;
+    }
+}
+
+static void bucket_json( std::ostream& os, const DhtBucketStats& bs )
+{
+    os << "{\"scanned\":"       << bs._scanned
+       << ",\"bytes_read\":"    << bs._bytes_read
+       << ",\"bytes_written\":" << bs._bytes_written
+       << ",\"opens\":"         << bs._opens
+       << ",\"lock_waits\":"    << bs._lock_waits
+       << ",\"lock_wait_ns\":"  << bs._lock_wait_ns
+       << '}';
+}
+
+// Histograms stop at their last non-empty bucket; element i counts
+// operations taking 2^i to 2^(i+1) ns.
+std::string DhtStats::json() const
+{
+    static const char *op_names[ DHT_OP_CNT ] = { "search", "insert", "upsert", "append", "update", "erase" };
+    std::ostringstream os;
+    os << "{\"ops\":{";
+    for ( size_t op(0); op < DHT_OP_CNT; ++op )
+    {
+        const DhtOpStats& ops = _ops[ op ];
+        os << ( op ? "," : "" ) << '"' << op_names[ op ] << "\":{\"count\":" << ops._count
+           << ",\"total_ns\":" << ops._total_ns << ",\"hist\":[";
+        size_t end = LAT_BUCKETS;
+        while ( end > 0 && ops._hist[ end - 1 ] == 0 )
+            end--;
+        for ( size_t b(0); b < end; ++b )
+            os << ( b ? "," : "" ) << ops._hist[ b ];
+        os << "]}";
+    }
+    os << "},\"hits\":" << _hits
+       << ",\"misses\":" << _misses
+       << ",\"total\":";
+    bucket_json( os, _total );
+    os << ",\"files\":{\"opens\":" << _files._opens
+       << ",\"closes\":"    << _files._closes
+       << ",\"open_fds\":"  << _files._open_fds
+       << ",\"capacity\":"  << _files._capacity
+       << "},\"bloom\":{\"buckets\":" << _bloom._buckets
+       << ",\"bytes\":"     << _bloom._bytes
+       << ",\"keys\":"      << _bloom._keys
+       << ",\"fpr\":"       << _bloom._fpr
+       << ",\"negatives\":" << _bloom._negatives
+       << ",\"false_positives\":" << _bloom._false_positives
+       << "},\"cache\":{\"capacity\":" << _cache._capacity
+       << ",\"entries\":"   << _cache._entries
+       << ",\"hits\":"      << _cache._hits
+       << ",\"misses\":"    << _cache._misses
+       << "},\"blocks\":{\"capacity\":" << _blocks._capacity
+       << ",\"entries\":"   << _blocks._entries
+       << ",\"hits\":"      << _blocks._hits
+       << ",\"misses\":"    << _blocks._misses
+       << '}';
+    if ( !_buckets.empty() )
+    {
+        os << ",\"buckets\":[";
+        for ( size_t b(0); b < _buckets.size(); ++b )
+        {
+            os << ( b ? "," : "" );
+            bucket_json( os, _buckets[ b ] );
+        }
+        os << ']';
+    }
+    os << '}';
+    return os.str();
+}
+
+std::string DiskHashTable::get_bucket_fspec( size_t bucket, bool* exists )
+{
+    return DiskHashTable::get_bucket_fspec( path, name, bucket_name( bucket ), exists );
+}
+
+std::string DiskHashTable::bucket_name( size_t bucket )
+{
+    char buff[ 2 * sizeof(size_t) + 1 ];
+    std::sprintf( buff, "%0*zx", BUCKET_ID_WIDTH, bucket );
+    return buff;
+}
+
+std::string DiskHashTable::get_bucket_fspec( const std::string path, const std::string base, const std::string bucket, bool* exists )
+{
+    std::stringstream ss;
+    ss << path << '/' << base << '_' << bucket;
+    if ( exists != nullptr )
+        *exists = std::filesystem::exists( ss.str() );
+    return ss.str();
+}
+
+bool DiskHashTable::default_comparitor( const void * lhs, const void * rhs, size_t keylen ) {
+    return std::memcmp(lhs, rhs, keylen) == 0;
+}
+
+uint64_t DiskHashTable::default_hasher( const void * key, size_t keylen )
+{
+    return hash64( key, keylen );
+}
+
+// The first 16 hex digits of the MD5, rotated so that the leading
+// BUCKET_ID_WIDTH digits - the bucket id of pre-header tables - land
+// in the low bits.
+uint64_t DiskHashTable::md5_hasher( const void * key, size_t keylen )
+{
+    MD5 md5;
+    md5.update( key, keylen );
+    md5.finalize();
+    uint64_t hash = std::stoull( md5.hexdigest().substr( 0, 16 ), nullptr, 16 );
+    const int bits = 4 * BUCKET_ID_WIDTH;
+    return ( hash << bits ) | ( hash >> ( 64 - bits ) );
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+// DhtBuilder
+//
+DhtBuilder::DhtBuilder()
+: held(0)
+, count(0)
+, spill_fd(-1)
+, spill_len(0)
+, building(false)
+, ok(false)
+{}
+
+DhtBuilder::~DhtBuilder()
+{
+    discard();
+}
+
+// start building base_name under path_name, which must not hold it yet
+bool DhtBuilder::open(
+    const std::string  path_name,
+    const std::string  base_name,
+    size_t             key_len,
+    size_t             val_len,
+    dht_comparitor     comp_func,
+    dht_hasher         hash_func,
+    const DhtOptions&  opts,
+    size_t             max_mem
+) {
+    discard();
+    std::stringstream ss;
+    ss << path_name << '/' << base_name << '/';
+    path      = path_name;
+    dir       = ss.str();
+    name      = base_name;
+    keylen    = key_len;
+    vallen    = val_len;
+    reclen    = key_len + val_len;
+    compfunc  = comp_func;
+    hashfunc  = hash_func;
+    options   = opts;
+    mem_bytes = std::max<size_t>( max_mem, BUILD_PARTS * reclen );
+    held      = 0;
+    count     = 0;
+    spill_len = 0;
+    spilled.clear();
+    runs.assign( BUILD_PARTS, std::vector<uchar>() );
+
+    std::filesystem::create_directories( dir );
+    bool exists = std::filesystem::exists( dir + name + ".dht" );
+    for ( auto& entry : std::filesystem::directory_iterator( dir ) )
+        if ( entry.path().filename().string().starts_with( name + '_' ) )
+            exists = true;
+    if ( exists )
+    {
+        std::cout << "Table " << dir << name << " already exists" << std::endl;
+        return false;
+    }
+    building = ok = true;
+    return true;
+}
+
+bool DhtBuilder::add( ucharptr_c key, ucharptr_c val )
+{
+    if ( !building || !ok )
+        return false;
+    std::vector<uchar>& run = runs[ hashfunc( key, keylen ) & ( BUILD_PARTS - 1 ) ];
+    run.insert( run.end(), key, key + keylen );
+    if ( val != nullptr )
+        run.insert( run.end(), val, val + vallen );
+    else
+        run.resize( run.size() + vallen, 0 );
+    count++;
+    held += reclen;
+    return held < mem_bytes || spill();
+}
+
+// write what is held to the end of the scratch file, a partition at a
+// time, and note where each partition went
+bool DhtBuilder::spill()
+{
+    if ( spill_fd == -1 )
+    {
+        spill_fd = ::open( spill_fspec().c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666 );
+        if ( spill_fd == -1 )
+        {
+            std::cout << "Error opening build file " << spill_fspec() << ' ' << errno << std::endl;
+            return ok = false;
+        }
+    }
+    std::vector<off_t> starts;
+    for ( auto& run : runs )
+    {
+        starts.push_back( spill_len );
+        if ( !pwrite_full( spill_fd, run.data(), run.size(), spill_len ) )
+        {
+            std::cout << "Error writing build file " << spill_fspec() << ' ' << errno << std::endl;
+            return ok = false;
+        }
+        spill_len += run.size();
+        run.clear();
+    }
+    starts.push_back( spill_len );
+    spilled.push_back( std::move( starts ) );
+    held = 0;
+    return true;
+}
+
+// Write out every bucket. Partition p holds the buckets whose low bits
+// are p, so with at least BUILD_PARTS buckets each partition fills a
+// group of buckets of its own, and with fewer each bucket takes a group
+// of partitions; either way a bucket is written once, start to end.
+bool DhtBuilder::finish()
+{
+    if ( !building )
+        return false;
+    if ( ok && !spilled.empty() && held != 0 )
+        spill();
+    if ( !ok )
+    {
+        discard();
+        return false;
+    }
+
+    size_t want = ( options.bucket_count != 0 ) ? options.bucket_count : BUCKET_HI;
+    if ( options.split_threshold != 0 )
+        want = std::max<size_t>( want, 2 * count / options.split_threshold + 1 );
+    size_t bucket_cnt = 1;
+    while ( bucket_cnt < want )
+        bucket_cnt <<= 1;
+
+    DhtOptions opts = options;
+    opts.bucket_count  = bucket_cnt;
+    opts.compact_ratio = 0;
+    opts.max_runs      = 0;
+    DiskHashTable dht;
+    if ( !dht.open( path, name, keylen, vallen, compfunc, hashfunc, opts ) )
+    {
+        discard();
+        return false;
+    }
+
+    size_t groups   = std::min<size_t>( bucket_cnt, BUILD_PARTS );
+    size_t per_grp  = bucket_cnt / groups;
+    size_t out_max  = std::max<size_t>( TABLE_BUFF_SIZE / reclen, mem_bytes / reclen / per_grp ) * reclen;
+    size_t read_max = TABLE_BUFF_SIZE / reclen * reclen;
+    std::vector<uchar> in;
+    for ( size_t g(0); g < groups && ok; ++g )
+    {
+        // bucket g + k * groups of this group goes to out[ k ]
+        std::vector<std::vector<uchar>> out( per_grp );
+        std::vector<int>    fds( per_grp, -1 );
+        std::vector<int>    vfds( per_grp, -1 );
+        std::vector<size_t> cnts( per_grp, 0 );
+        std::vector<uchar>  keys, vals, sorted;
+        std::vector<std::pair<uint64_t, size_t>> order;
+        auto write_out = [&]( size_t k ) {
+            auto& bp = dht.buckets[ g + k * groups ];
+            size_t n = out[ k ].size() / reclen;
+            if ( bp->_sorted )
+            {
+                // each piece goes in as a run of its own
+                order.resize( n );
+                for ( size_t i(0); i < n; ++i )
+                    order[ i ] = { bp->key_hash( out[ k ].data() + i * reclen, keylen ), i };
+                std::sort( order.begin(), order.end() );
+                sorted.resize( out[ k ].size() );
+                for ( size_t i(0); i < n; ++i )
+                    std::memcpy( sorted.data() + i * reclen, out[ k ].data() + order[ i ].second * reclen, reclen );
+                out[ k ].swap( sorted );
+            }
+            if ( fds[ k ] == -1 )
+                fds[ k ] = ::open( bp->_fspec.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+            if ( !bp->_split_vals )
+            {
+                ok = fds[ k ] != -1 && pwrite_full( fds[ k ], out[ k ].data(), out[ k ].size(), cnts[ k ] * reclen );
+            }
+            else
+            {
+                if ( vfds[ k ] == -1 )
+                    vfds[ k ] = ::open( bp->val_fspec().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+                keys.resize( n * keylen );
+                vals.resize( n * vallen );
+                for ( size_t i(0); i < n; ++i )
+                {
+                    std::memcpy( keys.data() + i * keylen, out[ k ].data() + i * reclen, keylen );
+                    std::memcpy( vals.data() + i * vallen, out[ k ].data() + i * reclen + keylen, vallen );
+                }
+                ok = fds[ k ] != -1 && vfds[ k ] != -1
+                  && pwrite_full( fds[ k ], keys.data(), keys.size(), cnts[ k ] * keylen )
+                  && pwrite_full( vfds[ k ], vals.data(), vals.size(), cnts[ k ] * vallen );
+            }
+            if ( !ok )
+                std::cout << "Error writing bucket file " << bp->_fspec << ' ' << errno << std::endl;
+            cnts[ k ] += n;
+            out[ k ].clear();
+        };
+        auto route = [&]( ucharptr_c recs, size_t len ) {
+            for ( const uchar *p = recs; p < recs + len && ok; p += reclen )
+            {
+                size_t k = ( per_grp == 1 ) ? 0 : ( hashfunc( p, keylen ) & ( bucket_cnt - 1 ) ) / groups;
+                out[ k ].insert( out[ k ].end(), p, p + reclen );
+                if ( out[ k ].size() >= out_max )
+                    write_out( k );
+            }
+        };
+        for ( size_t part( g ); part < BUILD_PARTS && ok; part += groups )
+        {
+            if ( spilled.empty() )
+            {
+                route( runs[ part ].data(), runs[ part ].size() );
+                std::vector<uchar>().swap( runs[ part ] );
+                continue;
+            }
+            for ( auto& starts : spilled )
+            {
+                for ( off_t pos = starts[ part ]; pos < starts[ part + 1 ] && ok; )
+                {
+                    size_t len = std::min<size_t>( read_max, starts[ part + 1 ] - pos );
+                    in.resize( len );
+                    if ( !pread_full( spill_fd, in.data(), len, pos ) )
+                    {
+                        std::cout << "Error reading build file " << spill_fspec() << ' ' << errno << std::endl;
+                        ok = false;
+                    }
+                    route( in.data(), len );
+                    pos += len;
+                }
+            }
+        }
+        for ( size_t k(0); k < per_grp && ok; ++k )
+            if ( !out[ k ].empty() )
+                write_out( k );
+        for ( size_t k(0); k < per_grp; ++k )
+        {
+            for ( int fd : { fds[ k ], vfds[ k ] } )
+            {
+                if ( fd == -1 )
+                    continue;
+                if ( dht.options.direct_io )
+                    drop_pages( fd );
+                ::close( fd );
+            }
+            auto& bp = dht.buckets[ g + k * groups ];
+            bp->_reccnt   = cnts[ k ];
+            bp->_disk_cnt = cnts[ k ];
+            dht.reccnt   += cnts[ k ];
+            // index, Bloom filter or runs while the file is still cached
+            if ( ok && ( options.use_index || options.bloom_fpr > 0 || bp->_sorted ) )
+                bp->prepare();
+            // a bucket written in more than one piece has as many runs
+            if ( ok && bp->_run_cnt > 1 )
+                ok = bp->compact( []( size_t ) { return true; } );
+        }
+    }
+    ok = dht.close() && ok;
+    bool done = ok;
+    discard();
+    return done;
+}
+
+// drop whatever is held and the scratch file
+void DhtBuilder::discard()
+{
+    if ( spill_fd != -1 )
+    {
+        ::close( spill_fd );
+        std::filesystem::remove( spill_fspec() );
+        spill_fd = -1;
+    }
+    runs.clear();
+    spilled.clear();
+    held     = 0;
+    building = false;
 }
 
 } // namespace libcf
\ No newline at end of file
@@ -0,0 +1,137 @@
+#include <sys/resource.h>
+#include "fpool.h"
+
+namespace libcf {
+
+#define FPOOL_MIN_FDS   16
+#define FPOOL_MAX_FDS   65536
+
+#define PINS_CLOSED     -1
+#define PINS_CLOSING    -2
+
+FilePool::FilePool(size_t capacity)
+: _capacity(capacity)
+, _open_fds(0)
+, _opens(0)
+, _closes(0)
+{}
+
+FilePool::~FilePool()
+{
+    std::lock_guard<std::mutex> lock( _mtx );
+    while ( !_lru.empty() )
+        close_nolock( *_lru.back() );
+}
+
+// half of the soft descriptor limit, leaving the rest to the application
+size_t FilePool::default_capacity()
+{
+    struct rlimit rl;
+    if ( getrlimit( RLIMIT_NOFILE, &rl ) != 0 || rl.rlim_cur == RLIM_INFINITY )
+        return FPOOL_MAX_FDS;
+    size_t cap = rl.rlim_cur / 2;
+    if ( cap < FPOOL_MIN_FDS )
+        cap = FPOOL_MIN_FDS;
+    if ( cap > FPOOL_MAX_FDS )
+        cap = FPOOL_MAX_FDS;
+    return cap;
+}
+
+void FilePool::resize(size_t capacity)
+{
+    std::lock_guard<std::mutex> lock( _mtx );
+    _capacity = capacity;
+    evict_nolock( 0 );
+}
+
+// pin pf, opening it if need be
+bool FilePool::borrow(PooledFile& pf)
+{
+    // already open - just add a pin, unless an eviction got there first
+    int pins = pf._pins.load( std::memory_order_acquire );
+    while ( pins >= 0 )
+    {
+        if ( pf._pins.compare_exchange_weak( pins, pins + 1, std::memory_order_acq_rel ) )
+        {
+            if ( !pf._touched.load( std::memory_order_relaxed ) )
+                pf._touched.store( true, std::memory_order_relaxed );
+            return true;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock( _mtx );
+    // evictions happen under the mutex, so this is stable now
+    if ( pf._pins.load( std::memory_order_acquire ) >= 0 )
+    {
+        pf._pins.fetch_add( 1, std::memory_order_acq_rel );
+        pf._touched.store( true, std::memory_order_relaxed );
+        return true;
+    }
+    evict_nolock( pf.pool_fds() );
+    if ( !pf.pool_open() )
+    {
+        pf.pool_close();
+        return false;
+    }
+    _opens++;
+    _open_fds += pf.pool_fds();
+    _lru.push_front( &pf );
+    pf._lru = _lru.begin();
+    pf._touched.store( false, std::memory_order_relaxed );
+    pf._pins.store( 1, std::memory_order_release );
+    return true;
+}
+
+void FilePool::release(PooledFile& pf)
+{
+    pf._pins.fetch_sub( 1, std::memory_order_acq_rel );
+    if ( _open_fds.load( std::memory_order_relaxed ) > _capacity )
+    {
+        std::lock_guard<std::mutex> lock( _mtx );
+        evict_nolock( 0 );
+    }
+}
+
+// pf is going away - close it and drop it from the pool
+void FilePool::forget(PooledFile& pf)
+{
+    std::lock_guard<std::mutex> lock( _mtx );
+    if ( pf._pins.load( std::memory_order_acquire ) != PINS_CLOSED )
+        close_nolock( pf );
+}
+
+FilePoolStats FilePool::stats()
+{
+    std::lock_guard<std::mutex> lock( _mtx );
+    return FilePoolStats{ _opens, _closes, _open_fds.load(), _capacity };
+}
+
+// Close unpinned files until want more descriptors fit under the
+// capacity. The hand sweeps from the back; a file used since the hand
+// last passed gets a second chance and goes round again, as does one
+// that is pinned. Two full sweeps is enough to have tried everything.
+void FilePool::evict_nolock(size_t want)
+{
+    size_t sweep = 2 * _lru.size();
+    while ( _open_fds + want > _capacity && sweep-- > 0 )
+    {
+        PooledFile& pf = *_lru.back();
+        int unpinned = 0;
+        if ( !pf._touched.exchange( false, std::memory_order_relaxed )
+          && pf._pins.compare_exchange_strong( unpinned, PINS_CLOSING, std::memory_order_acq_rel ) )
+            close_nolock( pf );
+        else
+            _lru.splice( _lru.begin(), _lru, pf._lru );
+    }
+}
+
+void FilePool::close_nolock(PooledFile& pf)
+{
+    pf.pool_close();
+    _closes++;
+    _open_fds -= pf.pool_fds();
+    _lru.erase( pf._lru );
+    pf._pins.store( PINS_CLOSED, std::memory_order_release );
+}
+
+} // namespace libcf
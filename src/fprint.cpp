@@ -0,0 +1,97 @@
+#include <cstring>
+#include "fprint.h"
+#include "keyscan.h"
+
+namespace libcf {
+
+typedef size_t (*fp_scan_fn)(const uint8_t *fps, size_t from, size_t cnt, uint16_t fp);
+
+template <class T>
+static size_t scan_scalar(const uint8_t *fps, size_t from, size_t cnt, uint16_t fp)
+{
+    for ( size_t i( from ); i < cnt; ++i )
+    {
+        T v;
+        std::memcpy( &v, fps + i * sizeof(T), sizeof(T) );
+        if ( v == (T)fp )
+            return i;
+    }
+    return cnt;
+}
+
+#if defined(__x86_64__)
+
+// sixteen bytes a step; a 16-bit match sets two bits of the mask
+template <class T>
+static size_t scan_sse2(const uint8_t *fps, size_t from, size_t cnt, uint16_t fp)
+{
+    const __m128i k = ( sizeof(T) == 1 ) ? _mm_set1_epi8( (char)fp ) : _mm_set1_epi16( (short)fp );
+    constexpr size_t STEP = 16 / sizeof(T);
+    size_t i = from;
+    for ( ; i + STEP <= cnt; i += STEP )
+    {
+        __m128i v = _mm_loadu_si128( (const __m128i*)( fps + i * sizeof(T) ) );
+        unsigned m = _mm_movemask_epi8( ( sizeof(T) == 1 ) ? _mm_cmpeq_epi8( v, k ) : _mm_cmpeq_epi16( v, k ) );
+        if ( m != 0 )
+            return i + __builtin_ctz( m ) / sizeof(T);
+    }
+    return scan_scalar<T>( fps, i, cnt, fp );
+}
+
+template <class T>
+__attribute__((target("avx2")))
+static size_t scan_avx2(const uint8_t *fps, size_t from, size_t cnt, uint16_t fp)
+{
+    const __m256i k = ( sizeof(T) == 1 ) ? _mm256_set1_epi8( (char)fp ) : _mm256_set1_epi16( (short)fp );
+    constexpr size_t STEP = 32 / sizeof(T);
+    size_t i = from;
+    for ( ; i + STEP <= cnt; i += STEP )
+    {
+        __m256i v = _mm256_loadu_si256( (const __m256i*)( fps + i * sizeof(T) ) );
+        uint32_t m = _mm256_movemask_epi8( ( sizeof(T) == 1 ) ? _mm256_cmpeq_epi8( v, k ) : _mm256_cmpeq_epi16( v, k ) );
+        if ( m != 0 )
+            return i + __builtin_ctz( m ) / sizeof(T);
+    }
+    return scan_scalar<T>( fps, i, cnt, fp );
+}
+
+#endif
+
+template <class T>
+static fp_scan_fn fp_scan_for()
+{
+#if defined(__x86_64__)
+    return key_scan_avx2() ? scan_avx2<T> : scan_sse2<T>;
+#else
+    return scan_scalar<T>;
+#endif
+}
+
+Fingerprints::Fingerprints(unsigned bits)
+: _width( ( bits <= 8 ) ? 1 : 2 )
+{}
+
+// the top bits of a multiply, so as not to repeat the bits the index
+// and Bloom filter take from the same hash
+uint16_t Fingerprints::of(uint64_t hash) const
+{
+    return ( hash * 0x9e3779b97f4a7c15ull ) >> ( 64 - bits() );
+}
+
+void Fingerprints::add(uint64_t hash)
+{
+    uint16_t fp = of( hash );
+    if ( _width == 1 )
+        _fps.push_back( (uint8_t)fp );
+    else
+        _fps.insert( _fps.end(), (const uint8_t*)&fp, (const uint8_t*)&fp + 2 );
+}
+
+size_t Fingerprints::next(uint64_t hash, size_t from) const
+{
+    static const fp_scan_fn scan8  = fp_scan_for<uint8_t>();
+    static const fp_scan_fn scan16 = fp_scan_for<uint16_t>();
+    return ( _width == 1 ? scan8 : scan16 )( _fps.data(), from, size(), of( hash ) );
+}
+
+} // namespace libcf
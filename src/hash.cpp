@@ -0,0 +1,95 @@
+#include <cstring>
+#include "hash.h"
+
+namespace libcf {
+
+static const uint64_t secret[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+    0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+
+static inline void mum128( uint64_t *a, uint64_t *b )
+{
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t mix( uint64_t a, uint64_t b )
+{
+    mum128( &a, &b );
+    return a ^ b;
+}
+
+static inline uint64_t r8( const uint8_t *p )
+{
+    uint64_t v;
+    std::memcpy( &v, p, 8 );
+    return v;
+}
+
+static inline uint64_t r4( const uint8_t *p )
+{
+    uint32_t v;
+    std::memcpy( &v, p, 4 );
+    return v;
+}
+
+static inline uint64_t r3( const uint8_t *p, size_t k )
+{
+    return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+uint64_t hash64( const void *key, size_t len, uint64_t seed )
+{
+    const uint8_t *p = (const uint8_t *)key;
+    uint64_t a, b;
+    seed ^= mix( seed ^ secret[0], secret[1] );
+    if ( len <= 16 )
+    {
+        if ( len >= 4 )
+        {
+            a = (r4( p ) << 32) | r4( p + ((len >> 3) << 2) );
+            b = (r4( p + len - 4 ) << 32) | r4( p + len - 4 - ((len >> 3) << 2) );
+        }
+        else if ( len > 0 )
+        {
+            a = r3( p, len );
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        size_t i = len;
+        if ( i > 48 )
+        {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = mix( r8( p      ) ^ secret[1], r8( p +  8 ) ^ seed );
+                see1 = mix( r8( p + 16 ) ^ secret[2], r8( p + 24 ) ^ see1 );
+                see2 = mix( r8( p + 32 ) ^ secret[3], r8( p + 40 ) ^ see2 );
+                p += 48;
+                i -= 48;
+            } while ( i > 48 );
+            seed ^= see1 ^ see2;
+        }
+        while ( i > 16 )
+        {
+            seed = mix( r8( p ) ^ secret[1], r8( p + 8 ) ^ seed );
+            i -= 16;
+            p += 16;
+        }
+        a = r8( p + i - 16 );
+        b = r8( p + i - 8 );
+    }
+    a ^= secret[1];
+    b ^= seed;
+    mum128( &a, &b );
+    return mix( a ^ secret[0] ^ len, b ^ secret[1] );
+}
+
+} // namespace libcf
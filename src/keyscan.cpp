@@ -0,0 +1,44 @@
+#include "keyscan.h"
+
+namespace libcf {
+
+bool key_scan_avx2()
+{
+#if defined(__x86_64__)
+    static const bool has = ( __builtin_cpu_init(), __builtin_cpu_supports( "avx2" ) );
+    return has;
+#else
+    return false;
+#endif
+}
+
+static size_t scan_generic(const unsigned char *recs, size_t cnt, size_t reclen, const unsigned char *key, size_t keylen)
+{
+    const unsigned char *p = recs;
+    for ( size_t i(0); i < cnt; ++i, p += reclen )
+        if ( std::memcmp( p, key, keylen ) == 0 )
+            return i;
+    return cnt;
+}
+
+// kernels for the usual key lengths, the generic loop for the rest
+key_scan_fn key_scan_for(size_t keylen)
+{
+    switch ( keylen )
+    {
+    case  4: return key_scan_for< 4>();
+    case  8: return key_scan_for< 8>();
+    case 12: return key_scan_for<12>();
+    case 16: return key_scan_for<16>();
+    case 20: return key_scan_for<20>();
+    case 24: return key_scan_for<24>();
+    case 28: return key_scan_for<28>();
+    case 32: return key_scan_for<32>();
+    case 40: return key_scan_for<40>();
+    case 48: return key_scan_for<48>();
+    case 64: return key_scan_for<64>();
+    default: return scan_generic;
+    }
+}
+
+} // namespace libcf
@@ -0,0 +1,204 @@
+#include <cstring>
+#include "hash.h"
+#include "rcache.h"
+
+namespace libcf {
+
+#define RCACHE_SEED         0x5ca1ab1e
+#define RCACHE_MAX_SHARDS   16
+#define RCACHE_MIN_SLOTS    64      // per shard, where capacity allows
+
+RecordCache::RecordCache(size_t capacity, size_t keylen, size_t vallen)
+: _keylen(keylen)
+, _vallen(vallen)
+, _reclen(keylen + vallen)
+{
+    if ( capacity == 0 )
+        capacity = 1;
+    _shard_cnt = 1;
+    while ( _shard_cnt < RCACHE_MAX_SHARDS && _shard_cnt * 2 * RCACHE_MIN_SLOTS <= capacity )
+        _shard_cnt *= 2;
+    _shard_cap = ( capacity + _shard_cnt - 1 ) / _shard_cnt;
+    // keep the open-addressed table at most half full
+    size_t tab_len = 2;
+    while ( tab_len < _shard_cap * 2 )
+        tab_len *= 2;
+    _shards.reset( new Shard[ _shard_cnt ] );
+    for ( size_t i(0); i < _shard_cnt; ++i )
+    {
+        Shard& s = _shards[ i ];
+        s._tab.assign( tab_len, 0 );
+        s._hash.assign( _shard_cap, 0 );
+        s._ref.assign( _shard_cap, 0 );
+        s._recs.assign( _shard_cap * _reclen, 0 );
+    }
+}
+
+uint64_t RecordCache::hash(const void *key) const
+{
+    return hash64( key, _keylen, RCACHE_SEED );
+}
+
+// copy key's value into val (if not null) and return true if cached
+bool RecordCache::get(const void *key, void *val)
+{
+    uint64_t h = hash( key );
+    Shard& s = shard( h );
+    std::lock_guard<std::mutex> lock( s._mtx );
+    size_t pos = find( s, h );
+    if ( s._tab[ pos ] != 0 )
+    {
+        size_t slot = s._tab[ pos ] - 1;
+        const uint8_t *rec = s._recs.data() + slot * _reclen;
+        if ( std::memcmp( rec, key, _keylen ) == 0 )
+        {
+            if ( val != nullptr && _vallen != 0 )
+                std::memcpy( val, rec + _keylen, _vallen );
+            s._ref[ slot ] = 1;
+            s._hits++;
+            return true;
+        }
+    }
+    s._misses++;
+    return false;
+}
+
+// add or replace key's entry; a null val caches a zero value
+void RecordCache::put(const void *key, const void *val)
+{
+    uint64_t h = hash( key );
+    Shard& s = shard( h );
+    std::lock_guard<std::mutex> lock( s._mtx );
+    size_t pos = find( s, h );
+    if ( s._tab[ pos ] != 0 )
+    {
+        // the same key, or one whose hash collides - either way it
+        // gives way
+        store( s, s._tab[ pos ] - 1, key, val );
+        return;
+    }
+    size_t slot;
+    if ( s._cnt < _shard_cap )
+    {
+        slot = s._cnt++;
+    }
+    else
+    {
+        // CLOCK: referenced entries get one more trip round
+        while ( s._ref[ s._hand ] != 0 )
+        {
+            s._ref[ s._hand ] = 0;
+            s._hand = ( s._hand + 1 ) % _shard_cap;
+        }
+        slot = s._hand;
+        s._hand = ( s._hand + 1 ) % _shard_cap;
+        remove( s, find( s, s._hash[ slot ] ) );
+        pos = find( s, h );
+    }
+    s._tab[ pos ] = slot + 1;
+    s._hash[ slot ] = h;
+    s._ref[ slot ] = 0;
+    store( s, slot, key, val );
+}
+
+// replace key's value if it is cached
+void RecordCache::refresh(const void *key, const void *val)
+{
+    uint64_t h = hash( key );
+    Shard& s = shard( h );
+    std::lock_guard<std::mutex> lock( s._mtx );
+    size_t pos = find( s, h );
+    if ( s._tab[ pos ] != 0 )
+    {
+        size_t slot = s._tab[ pos ] - 1;
+        if ( std::memcmp( s._recs.data() + slot * _reclen, key, _keylen ) == 0 )
+            store( s, slot, key, val );
+    }
+}
+
+// drop key's entry if it is cached; the shard's last entry moves into
+// the freed slot so the used slots stay contiguous
+void RecordCache::erase(const void *key)
+{
+    uint64_t h = hash( key );
+    Shard& s = shard( h );
+    std::lock_guard<std::mutex> lock( s._mtx );
+    size_t pos = find( s, h );
+    if ( s._tab[ pos ] == 0 )
+        return;
+    size_t slot = s._tab[ pos ] - 1;
+    if ( std::memcmp( s._recs.data() + slot * _reclen, key, _keylen ) != 0 )
+        return;
+    remove( s, pos );
+    size_t last = --s._cnt;
+    if ( slot != last )
+    {
+        s._tab[ find( s, s._hash[ last ] ) ] = slot + 1;
+        s._hash[ slot ] = s._hash[ last ];
+        s._ref[ slot ]  = s._ref[ last ];
+        std::memcpy( s._recs.data() + slot * _reclen, s._recs.data() + last * _reclen, _reclen );
+    }
+}
+
+RecordCacheStats RecordCache::stats()
+{
+    RecordCacheStats st{ _shard_cap * _shard_cnt, 0, 0, 0 };
+    for ( size_t i(0); i < _shard_cnt; ++i )
+    {
+        Shard& s = _shards[ i ];
+        std::lock_guard<std::mutex> lock( s._mtx );
+        st._entries += s._cnt;
+        st._hits    += s._hits;
+        st._misses  += s._misses;
+    }
+    return st;
+}
+
+// table position holding hash, or the free position where it would go
+size_t RecordCache::find(Shard& s, uint64_t hash) const
+{
+    size_t mask = s._tab.size() - 1;
+    size_t pos  = hash & mask;
+    while ( s._tab[ pos ] != 0 && s._hash[ s._tab[ pos ] - 1 ] != hash )
+        pos = ( pos + 1 ) & mask;
+    return pos;
+}
+
+// free a table position, shifting back later entries of its probe run
+// so lookups never stop short at the gap
+void RecordCache::remove(Shard& s, size_t pos)
+{
+    size_t mask = s._tab.size() - 1;
+    size_t next = pos;
+    while ( true )
+    {
+        next = ( next + 1 ) & mask;
+        if ( s._tab[ next ] == 0 )
+            break;
+        size_t home = s._hash[ s._tab[ next ] - 1 ] & mask;
+        // leave it if its home lies cyclically in (pos, next]
+        bool stays = ( pos < next ) ? ( pos < home && home <= next )
+                                    : ( pos < home || home <= next );
+        if ( !stays )
+        {
+            s._tab[ pos ] = s._tab[ next ];
+            pos = next;
+        }
+    }
+    s._tab[ pos ] = 0;
+}
+
+void RecordCache::store(Shard& s, size_t slot, const void *key, const void *val)
+{
+    uint8_t *rec = s._recs.data() + slot * _reclen;
+    std::memcpy( rec, key, _keylen );
+    if ( _vallen != 0 )
+    {
+        if ( val != nullptr )
+            std::memcpy( rec + _keylen, val, _vallen );
+        else
+            std::memset( rec + _keylen, 0, _vallen );
+    }
+}
+
+} // namespace libcf
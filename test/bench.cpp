@@ -0,0 +1,288 @@
+//
+// Benchmarks for DiskHashTable, DiskQueue and dstack.
+//
+// Every case prints one JSON object per line:
+//
+//   {"bench":"dht_search_hit","config":"index","records":100000,
+//    "threads":2,"ops":...,"secs":...,"ops_per_sec":...,
+//    "p50_ns":...,"p99_ns":...,"bytes_per_op":...}
+//
+// Each operation is timed on its own for the percentiles. bytes_per_op
+// is what the process read and wrote (rchar + wchar from /proc/self/io)
+// over the case, so it counts page cache hits as well as the disk.
+// Batched cases time each batch and count its keys as that many ops of
+// the batch's average latency.
+// Keys and orders come from fixed seeds, so runs are comparable.
+//
+//   bench [scale] [max threads]
+//
+// scale multiplies every size (default 1).
+//
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../include/libcf.h"
+
+struct Key
+{
+    uint64_t a;
+    uint64_t b;
+};
+
+struct Val
+{
+    uint64_t v;
+};
+
+#define BENCH_DIR   "/tmp"
+#define LOOKUPS     100000      // per dht search case, times scale
+#define MANY_BATCH  1024        // keys per search_many call
+
+typedef std::chrono::steady_clock Clock;
+
+static Key make_key( uint64_t n ) { return Key{ n * 0x9e3779b97f4a7c15ull, n }; }
+static Val make_val( uint64_t n ) { return Val{ n * 7 + 1 }; }
+
+uint64_t io_bytes()
+{
+    std::ifstream fs("/proc/self/io");
+    std::string tag;
+    uint64_t val, bytes(0);
+    while ( fs >> tag >> val )
+        if ( tag == "rchar:" || tag == "wchar:" )
+            bytes += val;
+    return bytes;
+}
+
+// the latencies of one case, from every thread
+struct Timings
+{
+    std::vector<std::vector<uint64_t>> ns;
+    Clock::time_point t0;
+    uint64_t          io0;
+
+    Timings(int threads) : ns(threads), t0(Clock::now()), io0(io_bytes()) {}
+
+    template <class F>
+    void time(int thread, F fn)
+    {
+        auto t = Clock::now();
+        fn();
+        ns[ thread ].push_back( std::chrono::duration_cast<std::chrono::nanoseconds>( Clock::now() - t ).count() );
+    }
+
+    template <class F>
+    void time_batch(int thread, uint64_t ops, F fn)
+    {
+        auto t = Clock::now();
+        fn();
+        uint64_t each = std::chrono::duration_cast<std::chrono::nanoseconds>( Clock::now() - t ).count() / ops;
+        ns[ thread ].insert( ns[ thread ].end(), ops, each );
+    }
+
+    void report(const std::string& bench, const std::string& config, uint64_t records, int threads)
+    {
+        double secs = std::chrono::duration<double>( Clock::now() - t0 ).count();
+        uint64_t bytes = io_bytes() - io0;
+        std::vector<uint64_t> all;
+        for ( auto& v : ns )
+            all.insert( all.end(), v.begin(), v.end() );
+        uint64_t ops = all.size();
+        auto pct = [&]( double p ) -> uint64_t {
+            if ( all.empty() )
+                return 0;
+            auto nth = all.begin() + (size_t)( p * ( all.size() - 1 ) );
+            std::nth_element( all.begin(), nth, all.end() );
+            return *nth;
+        };
+        uint64_t p50 = pct( 0.50 );
+        uint64_t p99 = pct( 0.99 );
+        std::cout << "{\"bench\":\""     << bench  << '"'
+                  << ",\"config\":\""    << config << '"'
+                  << ",\"records\":"     << records
+                  << ",\"threads\":"     << threads
+                  << ",\"ops\":"         << ops
+                  << ",\"secs\":"        << secs
+                  << ",\"ops_per_sec\":" << (uint64_t)( ops / secs )
+                  << ",\"p50_ns\":"      << p50
+                  << ",\"p99_ns\":"      << p99
+                  << ",\"bytes_per_op\":" << ( ops ? (double)bytes / ops : 0 )
+                  << '}' << std::endl;
+    }
+};
+
+// run fn( thread ) on threads threads and wait for them
+template <class F>
+void in_threads(int threads, F fn)
+{
+    std::vector<std::thread> pool;
+    for ( int i(1); i < threads; ++i )
+        pool.emplace_back( fn, i );
+    fn( 0 );
+    for ( auto& t : pool )
+        t.join();
+}
+
+// Fill a table with records keys from threads threads, then look up
+// keys that are there and keys that aren't.
+void bench_dht(const std::string& config, const libcf::DhtOptions& opts, uint64_t records, int threads, uint64_t lookups)
+{
+    std::string name = "bench_dht";
+    std::filesystem::remove_all( BENCH_DIR "/" + name );
+    {
+        libcf::DiskHashTable dht;
+        dht.open( BENCH_DIR, name, sizeof(Key), sizeof(Val),
+                  libcf::DiskHashTable::default_comparitor,
+                  libcf::DiskHashTable::default_hasher,
+                  opts );
+
+        Timings ins( threads );
+        in_threads( threads, [&]( int t ) {
+            for ( uint64_t n = t; n < records; n += threads )
+            {
+                Key k = make_key( n );
+                Val v = make_val( n );
+                ins.time( t, [&]{ dht.insert( (libcf::ucharptr_c)&k, (libcf::ucharptr_c)&v ); } );
+            }
+        });
+        dht.flush();
+        ins.report( "dht_insert", config, records, threads );
+
+        for ( bool hit : { true, false } )
+        {
+            Timings look( threads );
+            in_threads( threads, [&]( int t ) {
+                std::mt19937_64 rng( t );
+                for ( uint64_t i = t; i < lookups; i += threads )
+                {
+                    uint64_t n = rng() % records + ( hit ? 0 : records );
+                    Key k = make_key( n );
+                    Val v;
+                    look.time( t, [&]{ dht.search( (libcf::ucharptr_c)&k, (libcf::ucharptr)&v ); } );
+                }
+            });
+            look.report( hit ? "dht_search_hit" : "dht_search_miss", config, records, threads );
+        }
+
+        Timings many( threads );
+        in_threads( threads, [&]( int t ) {
+            std::mt19937_64 rng( t );
+            std::vector<Key> keys;
+            std::vector<Val> vals( MANY_BATCH );
+            std::vector<libcf::DhtResult> results( MANY_BATCH );
+            for ( uint64_t i = t; i < lookups; i += threads )
+            {
+                keys.push_back( make_key( rng() % records ) );
+                if ( keys.size() < MANY_BATCH && i + threads < lookups )
+                    continue;
+                many.time_batch( t, keys.size(), [&]{
+                    dht.search_many( keys.size(), (libcf::ucharptr_c)keys.data(), (libcf::ucharptr)vals.data(), results.data() );
+                });
+                keys.clear();
+            }
+        });
+        many.report( "dht_search_many", config, records, threads );
+    }
+    std::filesystem::remove_all( BENCH_DIR "/" + name );
+}
+
+// push records then pop them all, with blocks of block_size bytes
+void bench_dq(uint64_t records, libcf::dq_rec_no_t block_size)
+{
+    std::string name = "bench_dq";
+    std::filesystem::remove_all( BENCH_DIR "/" + name );
+    std::filesystem::create_directories( BENCH_DIR "/" + name );
+    std::string config = "block=" + std::to_string( block_size );
+    {
+        libcf::dq<Val> q( BENCH_DIR "/" + name, name, block_size );
+        Timings push( 1 );
+        for ( uint64_t n(0); n < records; ++n )
+        {
+            Val v = make_val( n );
+            push.time( 0, [&]{ q.push( v ); } );
+        }
+        push.report( "dq_push", config, records, 1 );
+
+        Timings pop( 1 );
+        for ( uint64_t n(0); n < records; ++n )
+        {
+            Val v;
+            pop.time( 0, [&]{ q.pop( v ); } );
+        }
+        pop.report( "dq_pop", config, records, 1 );
+    }
+    std::filesystem::remove_all( BENCH_DIR "/" + name );
+}
+
+void bench_dstack(uint64_t records)
+{
+    std::string fspec = BENCH_DIR "/bench_dstack";
+    std::filesystem::remove( fspec );
+    {
+        libcf::dstack<Val> s( fspec );
+        Timings push( 1 );
+        for ( uint64_t n(0); n < records; ++n )
+        {
+            Val v = make_val( n );
+            push.time( 0, [&]{ s.push( v ); } );
+        }
+        push.report( "dstack_push", "", records, 1 );
+
+        Timings pop( 1 );
+        for ( uint64_t n(0); n < records; ++n )
+            pop.time( 0, [&]{ s.pop(); } );
+        pop.report( "dstack_pop", "", records, 1 );
+    }
+    std::filesystem::remove( fspec );
+}
+
+int main(int argc, char **argv)
+{
+    double scale = ( argc > 1 ) ? std::atof( argv[1] ) : 1;
+    int max_threads = ( argc > 2 ) ? std::atoi( argv[2] ) : std::thread::hardware_concurrency();
+    if ( scale <= 0 )
+        scale = 1;
+    if ( max_threads < 1 )
+        max_threads = 1;
+
+    libcf::DhtOptions plain;
+
+    libcf::DhtOptions index;
+    index.use_index = true;
+    index.bloom_fpr = 0.01;
+
+    libcf::DhtOptions fprint;
+    fprint.fingerprint_bits = 16;
+
+    libcf::DhtOptions runs;
+    runs.sorted_runs = true;
+
+    libcf::DhtOptions direct;
+    direct.direct_io = true;
+    direct.direct_cache_bytes = 4 * 1024 * 1024;
+
+    std::vector<int> thread_counts{ 1 };
+    for ( int t(2); t < max_threads; t *= 2 )
+        thread_counts.push_back( t );
+    if ( max_threads > 1 )
+        thread_counts.push_back( max_threads );
+
+    uint64_t lookups = LOOKUPS * scale;
+    for ( auto& [config, opts] : { std::pair{ "plain", plain }, std::pair{ "index", index }, std::pair{ "fprint", fprint }, std::pair{ "runs", runs }, std::pair{ "direct", direct } } )
+        for ( uint64_t records : { 100000, 1000000 } )
+            for ( int threads : thread_counts )
+                bench_dht( config, opts, records * scale, threads, lookups );
+
+    for ( libcf::dq_rec_no_t block_size : { 4 * 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 } )
+        bench_dq( 200000 * scale, block_size );
+
+    bench_dstack( 200000 * scale );
+    return 0;
+}
@@ -0,0 +1,241 @@
+//
+// Multi-threaded stress and throughput test for DiskHashTable.
+//
+// For 1, 2, 4 ... up to the given number of threads, each thread inserts
+// its own range of keys, erasing every ERASE_EVERY'th again, while
+// looking up keys from the other threads' ranges, and every thread also
+// races to insert one shared set of keys. Afterwards the table must
+// hold each remaining key exactly once with the right value. This runs
+// with plain buckets, with splitting, the index, the record cache,
+// Bloom filters and background compaction switched on, and with
+// splitting and budgeted compaction over mapped, write-buffered
+// buckets, with splitting over write-buffered buckets read and written
+// through async I/O, with sorted runs merged in the background, and
+// with split values read through O_DIRECT and the block cache.
+//
+//   dht_stress [records per thread] [max threads]
+//
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../include/libcf.h"
+
+struct Key
+{
+    uint64_t a;
+    uint64_t b;
+};
+
+struct Val
+{
+    uint64_t v;
+};
+
+#define SHARED_KEYS 1000
+#define LOOKUPS     3       // per insert
+#define ERASE_EVERY 4
+
+static Key make_key( uint64_t n ) { return Key{ n, ~n }; }
+static Val make_val( uint64_t n ) { return Val{ n * 7 + 1 }; }
+static bool erased( uint64_t n )  { return n >= SHARED_KEYS && n % ERASE_EVERY == 0; }
+
+struct Counts
+{
+    uint64_t ops      = 0;
+    uint64_t shared   = 0;  // shared keys this thread inserted
+    uint64_t bad_vals = 0;  // lookups that found the wrong value
+    uint64_t failures = 0;  // own-range inserts that failed
+};
+
+void worker( libcf::DiskHashTable& dht, int idx, int threads, int records, Counts& cnt )
+{
+    std::mt19937_64 rng( idx );
+    uint64_t base = SHARED_KEYS + (uint64_t)idx * records;
+    for ( int i(0); i < records; ++i )
+    {
+        Key k = make_key( base + i );
+        Val v = make_val( base + i );
+        if ( !dht.insert( (libcf::ucharptr_c)&k, (libcf::ucharptr_c)&v ) )
+            cnt.failures++;
+        cnt.ops++;
+        if ( erased( base + i ) )
+        {
+            if ( !dht.erase( (libcf::ucharptr_c)&k ) )
+                cnt.failures++;
+            cnt.ops++;
+        }
+
+        if ( i % ( records / SHARED_KEYS + 1 ) == 0 )
+        {
+            uint64_t n = rng() % SHARED_KEYS;
+            Key sk = make_key( n );
+            Val sv = make_val( n );
+            if ( dht.insert( (libcf::ucharptr_c)&sk, (libcf::ucharptr_c)&sv ) )
+                cnt.shared++;
+            cnt.ops++;
+        }
+
+        for ( int j(0); j < LOOKUPS; ++j )
+        {
+            uint64_t n = SHARED_KEYS + ( rng() % threads ) * records + rng() % records;
+            Key lk = make_key( n );
+            Val lv;
+            if ( dht.search( (libcf::ucharptr_c)&lk, (libcf::ucharptr)&lv )
+              && lv.v != make_val( n ).v )
+                cnt.bad_vals++;
+            cnt.ops++;
+        }
+    }
+}
+
+bool run( const std::string& label, const libcf::DhtOptions& opts, int threads, int records )
+{
+    std::string name = "dht_stress_" + label;
+    std::filesystem::remove_all( "/tmp/" + name );
+    bool ok = true;
+    double secs;
+    uint64_t ops(0);
+    {
+        libcf::DiskHashTable dht;
+        dht.open( "/tmp", name, sizeof(Key), sizeof(Val),
+                  libcf::DiskHashTable::default_comparitor,
+                  libcf::DiskHashTable::default_hasher,
+                  opts );
+
+        std::vector<Counts> counts( threads );
+        std::vector<std::thread> pool;
+        auto t0 = std::chrono::steady_clock::now();
+        for ( int i(0); i < threads; ++i )
+            pool.emplace_back( worker, std::ref( dht ), i, threads, records, std::ref( counts[ i ] ) );
+        for ( auto& t : pool )
+            t.join();
+        secs = std::chrono::duration<double>( std::chrono::steady_clock::now() - t0 ).count();
+
+        // each shared key that was drawn at all went in exactly once
+        uint64_t shared(0), bad_vals(0), failures(0);
+        for ( auto& c : counts )
+        {
+            ops      += c.ops;
+            shared   += c.shared;
+            bad_vals += c.bad_vals;
+            failures += c.failures;
+        }
+        uint64_t present(0);
+        for ( uint64_t n(0); n < SHARED_KEYS; ++n )
+        {
+            Key k = make_key( n );
+            Val v;
+            if ( dht.search( (libcf::ucharptr_c)&k, (libcf::ucharptr)&v ) )
+            {
+                present++;
+                ok = ok && v.v == make_val( n ).v;
+            }
+        }
+        for ( uint64_t n(SHARED_KEYS); n < SHARED_KEYS + (uint64_t)threads * records; ++n )
+        {
+            Key k = make_key( n );
+            Val v;
+            if ( erased( n ) )
+                ok = ok && !dht.search( (libcf::ucharptr_c)&k, (libcf::ucharptr)&v );
+            else
+                ok = ok && dht.search( (libcf::ucharptr_c)&k, (libcf::ucharptr)&v ) && v.v == make_val( n ).v;
+        }
+        uint64_t expect = present;
+        for ( uint64_t n(SHARED_KEYS); n < SHARED_KEYS + (uint64_t)threads * records; ++n )
+            expect += !erased( n );
+        if ( shared != present || dht.size() != expect || bad_vals != 0 || failures != 0 )
+            ok = false;
+        if ( !ok )
+            std::cout << label << " threads=" << threads << " FAILED"
+                      << " shared=" << shared << '/' << present
+                      << " size=" << dht.size() << '/' << expect
+                      << " bad_vals=" << bad_vals
+                      << " failures=" << failures << std::endl;
+    }
+    std::filesystem::remove_all( "/tmp/" + name );
+    if ( ok )
+        std::cout << label
+                  << " threads=" << threads
+                  << " ops=" << ops
+                  << " secs=" << secs
+                  << " ops/s=" << (uint64_t)( ops / secs )
+                  << std::endl;
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    int records = ( argc > 1 ) ? std::atoi( argv[1] ) : 20000;
+    int max_threads = ( argc > 2 ) ? std::atoi( argv[2] ) : std::thread::hardware_concurrency();
+    if ( max_threads < 1 )
+        max_threads = 1;
+
+    libcf::DhtOptions plain;
+
+    libcf::DhtOptions full;
+    full.use_index       = true;
+    full.bloom_fpr       = 0.01;
+    full.bucket_count    = 16;
+    full.split_threshold = 2000;
+    full.cache_records   = 4096;
+    full.compact_ratio   = 0.1;
+
+    libcf::DhtOptions mapped;
+    mapped.use_mmap        = true;
+    mapped.write_buffer    = 64 * 1024;
+    mapped.bucket_count    = 16;
+    mapped.split_threshold = 2000;
+    mapped.compact_ratio   = 0.1;
+    mapped.compact_bytes_per_sec = 16 * 1024 * 1024;
+
+    libcf::DhtOptions async;
+    async.async_io        = true;
+    async.write_buffer    = 64 * 1024;
+    async.bucket_count    = 16;
+    async.split_threshold = 2000;
+
+    libcf::DhtOptions split;
+    split.split_values    = true;
+    split.fingerprint_bits = 8;
+    split.bloom_fpr       = 0.01;
+    split.write_buffer    = 64 * 1024;
+    split.bucket_count    = 16;
+    split.split_threshold = 2000;
+    split.compact_ratio   = 0.1;
+
+    libcf::DhtOptions runs;
+    runs.sorted_runs     = true;
+    runs.max_runs        = 4;
+    runs.write_buffer    = 16 * 1024;
+    runs.bloom_fpr       = 0.01;
+    runs.bucket_count    = 16;
+    runs.split_threshold = 2000;
+    runs.compact_ratio   = 0.1;
+
+    libcf::DhtOptions direct;
+    direct.direct_io       = true;
+    direct.direct_cache_bytes = 256 * 1024;
+    direct.split_values    = true;
+    direct.write_buffer    = 64 * 1024;
+    direct.bucket_count    = 16;
+    direct.split_threshold = 2000;
+    direct.compact_ratio   = 0.1;
+
+    bool ok = true;
+    for ( auto& [label, opts] : { std::pair{ "plain", plain }, std::pair{ "full", full }, std::pair{ "mapped", mapped }, std::pair{ "async", async }, std::pair{ "split", split }, std::pair{ "runs", runs }, std::pair{ "direct", direct } } )
+    {
+        for ( int threads(1); ; threads *= 2 )
+        {
+            threads = std::min( threads, max_threads );
+            ok = run( label, opts, threads, records ) && ok;
+            if ( threads == max_threads )
+                break;
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -1,11 +1,12 @@
 //
-// Verify that all records in a DiskHashTable are unique, even accross buckets.
+// Verify that all records in a DiskHashTable are unique, even accross buckets,
+// or build a new one from a file of records.
 //
 #include <iostream>
 #include <cassert>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
-#include <set>
 #include <sstream>
 
 #include "../include/libcf.h"
@@ -107,84 +108,195 @@ void usage(std::string prog)
     std::cout << "DiskHashTable Utility\n"
               << "usage:\n"
               << '\t' << prog << " verify <path_to_dht_root> <dht_base_name> [options]\n"
+              << '\t' << prog << " load <path_to_dht_root> <dht_base_name> <record_file> [options]\n"
+              << '\t' << prog << " stats <path_to_dht_root> <dht_base_name> [options]\n"
               << '\t' << prog << " test [options]\n"
-              << "note: there are no options yet\n"
+              << "verify options:\n"
+              << "\t-t <n>    threads (default one per core)\n"
+              << "load options:\n"
+              << "\t-b <n>    bucket count (default " << libcf::BUCKET_HI << ")\n"
+              << "\t-s <n>    split threshold\n"
+              << "\t-i        build the bucket indexes\n"
+              << "\t-f <fpr>  build Bloom filters with this false positive rate\n"
+              << "\t-v        keep values in files of their own\n"
+              << "\t-m <MiB>  memory for records held before spilling\n"
+              << "stats options:\n"
+              << "\t-n <n>    keys to look up, half of them present (default 10000)\n"
+              << "\t-i        look up through the bucket indexes\n"
+              << "\t-b        include per-bucket counts\n"
+              << "note: test has no options yet\n"
               << std::endl;
     exit(1);
 }
 
+// Each bucket is checked for duplicate keys on its own, in parallel;
+// see DiskHashTable::verify().
 void command_verify(int argc, char **argv)
 {
     if (argc < 4)
         usage(argv[0]);
 
-    std::set<PositionPacked> cache;
-    int rec_cnt(0);
-    int dupe_cnt(0);
+    unsigned threads(0);
+    for (int i = 4; i < argc; i++)
+    {
+        std::string opt = argv[i];
+        if (i + 1 < argc && opt == "-t")
+            threads = std::stoul(argv[++i]);
+        else
+            usage(argv[0]);
+    }
 
     std::filesystem::path path(argv[2]);
-    if (!std::filesystem::exists(path))
+    std::string base(argv[3]);
+    if (!std::filesystem::exists(path / base))
     {
-        std::cerr << path << " does not exist" << std::endl;
+        std::cerr << path / base << " does not exist" << std::endl;
         exit(1);
     }
-    std::string base(argv[3]);
-    std::string min_buck;
-    std::string max_buck;
-    int frec_min(999999999);
-    int frec_max(-1);
-    int buckets = 1 << (4 * BUCKET_ID_WIDTH );
-    for (int i = 0; i < buckets; i++)
+    libcf::dht<PositionPacked,PosInfo> tdht(path, base);
+    auto t0 = std::chrono::steady_clock::now();
+    libcf::DhtVerifyStats st = tdht.verify(threads);
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cout << "records    " << st._records << '\n'
+              << "duplicates " << st._duplicates << '\n'
+              << "misplaced  " << st._misplaced << '\n'
+              << "buckets    " << st._buckets << '\n'
+              << "min        " << libcf::DiskHashTable::bucket_name(st._min_bucket) << ':' << st._min << '\n'
+              << "max        " << libcf::DiskHashTable::bucket_name(st._max_bucket) << ':' << st._max << '\n'
+              << "spread     " << (st._max - st._min) << '\n'
+              << "mean       " << st._mean << '\n'
+              << "stddev     " << st._stddev << '\n'
+              << "secs       " << secs
+              << std::endl;
+    if (st._duplicates != 0 || st._misplaced != 0)
+        exit(1);
+}
+
+// The record file holds PositionPacked keys each followed by its PosInfo,
+// as in a bucket file; "-" reads standard input.
+void command_load(int argc, char **argv)
+{
+    if (argc < 5)
+        usage(argv[0]);
+
+    libcf::DhtOptions opts;
+    size_t mem = BUILD_MEM;
+    for (int i = 5; i < argc; i++)
     {
-        char bucket[BUCKET_ID_WIDTH + 1];
-        std::sprintf(bucket, "%0*x", BUCKET_ID_WIDTH, i);
+        std::string opt = argv[i];
+        if (opt == "-i")
+            opts.use_index = true;
+        else if (opt == "-v")
+            opts.split_values = true;
+        else if (i + 1 < argc && opt == "-b")
+            opts.bucket_count = std::stoul(argv[++i]);
+        else if (i + 1 < argc && opt == "-s")
+            opts.split_threshold = std::stoul(argv[++i]);
+        else if (i + 1 < argc && opt == "-f")
+            opts.bloom_fpr = std::stod(argv[++i]);
+        else if (i + 1 < argc && opt == "-m")
+            mem = std::stoul(argv[++i]) * 1024 * 1024;
+        else
+            usage(argv[0]);
+    }
 
-        std::string fspec = libcf::DiskHashTable::get_bucket_fspec(path, base, bucket);
-        if (!std::filesystem::exists(fspec))
-        {
-            std::cerr << fspec << " does not exist" << std::endl;
-            continue;
-        }
-        std::FILE *fp = std::fopen( fspec.c_str(), "r" );
-        if ( fp == nullptr )
-        {
-            std::cerr << "Error opening bucket file " << fspec << ' ' << errno << " - terminating" << std::endl;
-            exit(errno);
-        }
-        PositionPacked pp;
-        PosInfo pi;
-        int frec_cnt(0);
-        while (std::fread(&pp, sizeof(PositionPacked), 1, fp) == 1)
-        {
-            std::fread(&pi, sizeof(PosInfo), 1, fp);
-            frec_cnt++;
-            if (cache.contains(pp))
-                dupe_cnt++;
-            else
-                cache.insert(pp);
-            if ((++rec_cnt % 1000) == 0 )
-                std::cout << fspec << ':' << cache.size() << ' ' << dupe_cnt << ' ' << frec_cnt << '\r' << std::flush;
-        }
-        std::fclose(fp);
-        if ( frec_cnt < frec_min)
-        {
-            frec_min = frec_cnt;
-            min_buck = bucket;
-        }
-        if ( frec_cnt > frec_max)
+    std::string src(argv[4]);
+    std::FILE *fp = (src == "-") ? stdin : std::fopen(src.c_str(), "r");
+    if (fp == nullptr)
+    {
+        std::cerr << "Error opening " << src << ' ' << errno << std::endl;
+        exit(1);
+    }
+    libcf::DhtBuilder builder;
+    if (!builder.open(argv[2], argv[3], sizeof(PositionPacked), sizeof(PosInfo),
+                      libcf::DiskHashTable::default_comparitor,
+                      libcf::DiskHashTable::default_hasher,
+                      opts, mem))
+        exit(1);
+
+    auto t0 = std::chrono::steady_clock::now();
+    const size_t reclen = sizeof(PositionPacked) + sizeof(PosInfo);
+    std::vector<libcf::uchar> buff(reclen * 4096);
+    size_t cnt;
+    while ((cnt = std::fread(buff.data(), reclen, 4096, fp)) > 0)
+    {
+        for (size_t i = 0; i < cnt; i++)
         {
-            frec_max = frec_cnt;
-            max_buck = bucket;
+            libcf::ucharptr rec = buff.data() + i * reclen;
+            if (!builder.add(rec, rec + sizeof(PositionPacked)))
+                exit(1);
         }
+        if ((builder.size() % (1024 * 1024)) < cnt)
+            std::cout << builder.size() << '\r' << std::flush;
     }
-    std::cout << '\n'
-              << cache.size() << ' '
-              << min_buck << ':' << frec_min << ' '
-              << max_buck << ':' << frec_max << ' '
-              << (frec_max - frec_min)
+    if (fp != stdin)
+        std::fclose(fp);
+    if (!builder.finish())
+        exit(1);
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cout << builder.size() << " records in "
+              << secs << "s ("
+              << (uint64_t)(builder.size() / secs) << "/s)"
               << std::endl;
 }
 
+// Time lookups of keys sampled from the table and of keys that aren't
+// in it, then print the table's stats as JSON.
+void command_stats(int argc, char **argv)
+{
+    if (argc < 4)
+        usage(argv[0]);
+
+    libcf::DhtOptions opts;
+    opts.latency_stats = true;
+    size_t lookups(10000);
+    bool per_bucket(false);
+    for (int i = 4; i < argc; i++)
+    {
+        std::string opt = argv[i];
+        if (opt == "-b")
+            per_bucket = true;
+        else if (opt == "-i")
+            opts.use_index = true;
+        else if (i + 1 < argc && opt == "-n")
+            lookups = std::stoul(argv[++i]);
+        else
+            usage(argv[0]);
+    }
+
+    std::filesystem::path path(argv[2]);
+    std::string base(argv[3]);
+    if (!std::filesystem::exists(path / base))
+    {
+        std::cerr << path / base << " does not exist" << std::endl;
+        exit(1);
+    }
+    libcf::dht<PositionPacked,PosInfo> tdht(path, base,
+                                            libcf::DiskHashTable::default_comparitor,
+                                            libcf::DiskHashTable::default_hasher,
+                                            opts);
+    std::vector<PositionPacked> keys;
+    size_t every = std::max<size_t>(1, tdht.size() / std::max<size_t>(1, lookups / 2));
+    size_t n(0);
+    for (auto itr = tdht.begin(); itr != tdht.end() && keys.size() < lookups / 2; ++itr, ++n)
+        if (n % every == 0)
+            keys.push_back((*itr).first);
+    // the same keys, changed so they (almost surely) aren't there
+    size_t present = keys.size();
+    for (size_t i = 0; i < present; i++)
+    {
+        PositionPacked pp = keys[i];
+        pp.hi = ~pp.hi;
+        pp.lo = ~pp.lo;
+        keys.push_back(pp);
+    }
+    tdht.reset_stats();
+    PosInfo pi;
+    for (auto& pp : keys)
+        tdht.search(pp, pi);
+    std::cout << tdht.stats(per_bucket).json() << std::endl;
+}
+
 void command_test(int argc, char **argv)
 {
     // create a temporary dht
@@ -241,6 +353,10 @@ int main(int argc, char **argv)
     std::string cmd = argv[1];
     if ( cmd == "verify" )
         command_verify(argc, argv);
+    else if (cmd == "load" )
+        command_load(argc, argv);
+    else if (cmd == "stats" )
+        command_stats(argc, argv);
     else if (cmd == "test" )
         command_test(argc, argv);
     else
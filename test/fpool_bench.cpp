@@ -0,0 +1,105 @@
+//
+// Compare the per-lookup system call cost of a DiskHashTable with and
+// without its bucket file pool.
+//
+// Read/write syscall counts come from /proc/self/io; open/close counts
+// come from the pool itself.
+//
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "../include/libcf.h"
+
+struct Key
+{
+    uint64_t a;
+    uint64_t b;
+};
+
+struct Val
+{
+    uint64_t v;
+};
+
+struct IoCounts
+{
+    uint64_t syscr;
+    uint64_t syscw;
+};
+
+IoCounts read_io()
+{
+    IoCounts io{0, 0};
+    std::ifstream fs("/proc/self/io");
+    std::string tag;
+    uint64_t val;
+    while ( fs >> tag >> val )
+    {
+        if ( tag == "syscr:" )
+            io.syscr = val;
+        else if ( tag == "syscw:" )
+            io.syscw = val;
+    }
+    return io;
+}
+
+void run(const std::string& label, long max_open_files, int records, int lookups)
+{
+    libcf::DhtOptions opts;
+    opts.max_open_files = max_open_files;
+    std::string name = "fpool_bench_" + label;
+    std::filesystem::remove_all( "/tmp/" + name );
+
+    libcf::DiskHashTable dht;
+    dht.open( "/tmp", name, sizeof(Key), sizeof(Val),
+              libcf::DiskHashTable::default_comparitor,
+              libcf::DiskHashTable::default_hasher,
+              opts );
+    for ( int i(0); i < records; ++i )
+    {
+        Key k{ (uint64_t)i, 0 };
+        Val v{ (uint64_t)i * 2 };
+        dht.append( (libcf::ucharptr_c)&k, (libcf::ucharptr_c)&v );
+    }
+
+    std::mt19937_64 rng(42);
+    libcf::FilePoolStats fs0 = dht.file_stats();
+    IoCounts io0 = read_io();
+    auto t0 = std::chrono::steady_clock::now();
+    int found(0);
+    for ( int i(0); i < lookups; ++i )
+    {
+        Key k{ rng() % records, 0 };
+        Val v;
+        if ( dht.search( (libcf::ucharptr_c)&k, (libcf::ucharptr)&v ) )
+            found++;
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    IoCounts io1 = read_io();
+    libcf::FilePoolStats fs1 = dht.file_stats();
+
+    double n = lookups;
+    double us = std::chrono::duration<double, std::micro>(t1 - t0).count();
+    std::cout << label
+              << " found="      << found
+              << " opens/op="   << ( fs1._opens  - fs0._opens  ) / n
+              << " closes/op="  << ( fs1._closes - fs0._closes ) / n
+              << " reads/op="   << ( io1.syscr   - io0.syscr   ) / n
+              << " writes/op="  << ( io1.syscw   - io0.syscw   ) / n
+              << " us/op="      << us / n
+              << std::endl;
+    std::filesystem::remove_all( "/tmp/" + name );
+}
+
+int main(int argc, char **argv)
+{
+    int records = ( argc > 1 ) ? std::atoi( argv[1] ) : 100000;
+    int lookups = ( argc > 2 ) ? std::atoi( argv[2] ) : 100000;
+    run( "unpooled", -1, records, lookups );
+    run( "pooled",    0, records, lookups );
+    return 0;
+}